@@ -30,6 +30,18 @@
 #include "lua53.h"
 #include "lz4.h"
 
+// SIMD kernels for the audio mixer
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PX_AUDIO_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PX_AUDIO_NEON
+#endif
+
+// lets the compiler vectorize loops over several arrays
+#define PX_RESTRICT __restrict
+
 // SDL2 pragmas (MS VS C++)
 #ifdef _WIN32
 #pragma comment(lib, "SDL2.lib")
@@ -53,6 +65,13 @@ typedef int socklen_t;
 #define closesocket(s) close(s)
 #endif // _WIN32
 
+// archive includes
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif // _WIN32
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -73,12 +92,71 @@ typedef int socklen_t;
 
 // Audio settings
 #define PX_AUDIO_CHANNELS     8
+#define PX_AUDIO_VOICES       64
+#define PX_AUDIO_POOL         32
 #define PX_AUDIO_FREQUENCY    44100
-#define PX_AUDIO_NOISE        1024
-
-// Frame time
-#define PX_FPS                30
-#define PX_FPS_TICKS          (1000 / PX_FPS)
+#define PX_AUDIO_SAMPLES      1024
+#define PX_AUDIO_MIN_SAMPLES  256
+#define PX_AUDIO_MAX_SAMPLES  8192
+#define PX_AUDIO_VOLUME       256
+#define PX_AUDIO_BLOCK        256
+#define PX_AUDIO_COMMANDS     256
+#define PX_AUDIO_RELEASES     (PX_AUDIO_COMMANDS + PX_AUDIO_VOICES + 2)
+#define PX_AUDIO_HISTOGRAM    64
+#define PX_AUDIO_MARKERS      256
+#define PX_AUDIO_NOISE_BITS   10
+#define PX_AUDIO_NOISE        (1 << PX_AUDIO_NOISE_BITS)
+#define PX_AUDIO_NOTES        128
+#define PX_AUDIO_NOTE_OFFSET  12
+#define PX_AUDIO_WRITER       (1024 * 1024)
+#define PX_MML_CACHE          "pixl.mml"
+#define PX_SONG_TYPE          "pixl.song"
+#define PX_BUFFER_TYPE        "pixl.buffer"
+#define PX_ENTITIES_TYPE      "pixl.entities"
+#define PX_SONG_MAX_SIZE      (16 * 1024 * 1024)
+
+// Precompiled games
+#define PX_BYTECODE_MAX_SIZE  (256 * 1024 * 1024)
+
+// Archives
+#define PX_ARCHIVE_INDEX      "pixl.archive"
+#define PX_ARCHIVE_ASSETS     "pixl.assets"
+#define PX_ARCHIVE_MAX_ENTRY  (256 * 1024 * 1024)
+
+// Profiler
+#define PX_PROFILE_INTERVAL   1       // milliseconds between samples
+#define PX_PROFILE_DEPTH      32
+#define PX_PROFILE_FUNCTIONS  1024    // hash table sizes, powers of two
+#define PX_PROFILE_LINES      4096
+#define PX_PROFILE_STACKS     4096
+#define PX_PROFILE_REPORT     40      // lines in the flat report
+
+// Tick rate, see -tickrate
+#define PX_TICK_RATE          30    // updates per second
+#define PX_MAX_TICK_RATE      1000
+#define PX_MAX_CATCHUP        5     // updates per frame, the rest is skipped after a stall
+
+// Frame timings, see f_stats()
+#define PX_FRAME_HISTORY      128   // frames kept for the percentiles
+#define PX_STATS_COLUMNS      19    // size of the overlay in characters
+#define PX_STATS_ROWS         (PX_STAGE_LAST + 1)
+
+// Entity stores
+#define PX_ENTITY_FIELDS      16
+#define PX_ENTITY_NAME        16    // including the terminating 0
+
+// Coroutine scheduler
+#define PX_SCHED_SLOTS        256   // timing wheel size, a power of two
+
+// Lua allocator
+#define PX_ALLOC_GRANULE      16    // size classes and alignment
+#define PX_ALLOC_CLASSES      16    // blocks up to 256 bytes come from slabs
+#define PX_ALLOC_SLAB         (64 * 1024)
+
+// Garbage collection in idle time
+#define PX_GC_RESERVE         4     // milliseconds left for rendering
+#define PX_GC_GROWTH          2     // memory growth which starts the next cycle
+#define PX_GC_LIMIT           2     // growth beyond the threshold which lets Lua collect during a frame
 
 // Number of controllers
 #define PX_NUM_CONTROLLERS    8
@@ -114,26 +192,145 @@ enum {
   PX_WAVEFORM_NOISE
 };
 
+typedef struct AudioEvent {
+  Uint32 step;        // phase increment per sample (2^32 is one cycle)
+  int duration;       // length of the event in samples
+  int gate;           // number of samples the note is audible
+  int waveform;
+  int volume;         // note amplitude (0 - 256)
+  int pan;            // new channel pan (0 - 16) or -1 to keep it
+  int marker;         // marker id reported to Lua or -1 for notes and rests
+} AudioEvent;
+
+typedef struct AudioProgram {
+  // compiled MML string
+  AudioEvent *events;
+  int count;
+  int length;         // total length in samples
+} AudioProgram;
+
+typedef struct AudioSong {
+  // patterns of MML programs played on the first channels in the given order
+  int channels, patterns, orders;
+  int *order;         // pattern index of every order entry
+  int *lengths;       // pattern length in samples
+  const AudioProgram **programs;  // patterns * channels, NULL for silent channels
+} AudioSong;
+
+typedef struct AudioSongPlayer {
+  const AudioSong *song;
+  int ref;
+  int looping;
+  int order;          // next order entry
+  int remaining;      // samples left in the current pattern
+  Uint32 position;    // samples since the song was started
+} AudioSongPlayer;
+
+typedef struct AudioSample {
+  const void *data;   // PCM data of a pinned Lua string
+  int length;         // number of samples
+  int bits;           // 8 or 16
+  Uint32 step;        // 16.16 fixed point resampling step
+} AudioSample;
+
 typedef struct AudioChannel {
-  // MML source and current pointer
-  const char *source;
-  const char *in;
+  // program and current event, or the sample being played
+  const AudioProgram *program;
+  AudioSample sample;
+  int ref;            // registry reference keeping the program or sample alive
+  int voice;          // index in channels[] or -1 for private channels
+  int generation;     // sfx allocation this channel plays
+  int event;
   int looping;
+  int volume;         // channel volume (0 - 256)
+  int pan;            // -256 (left) - 256 (right)
   // current waveform settings
-  float t;
-  float frequency;
+  Uint32 phase;
+  Uint32 step;
   int waveform;
+  int amplitude;
   int duration;
   int silence;
-  // current parse settings
-  int tempo;
-  int octave;
-  int default_length;
+  // sample position
+  Uint32 position;
+  Uint32 fraction;
+  // music clock
+  Uint32 clock;       // samples mixed since the program or sample was started
+  int events;         // notes and rests started since then
 } AudioChannel;
 
-AudioChannel channels[PX_AUDIO_CHANNELS];
+enum {
+  PX_AUDIO_PLAY, PX_AUDIO_PLAY_SAMPLE, PX_AUDIO_STOP, PX_AUDIO_PAUSE, PX_AUDIO_SET_VOLUME, PX_AUDIO_SET_PAN,
+  PX_AUDIO_RESET_STATS, PX_AUDIO_PLAY_SONG, PX_AUDIO_STOP_SONG
+};
+
+typedef struct AudioCommand {
+  int type;
+  int channel;
+  const AudioProgram *program;
+  const AudioSong *song;
+  AudioSample sample;
+  int ref;
+  int generation;
+  int value;          // looping flag, pause flag, volume or pan
+} AudioCommand;
+
+typedef struct AudioVoice {
+  int generation;     // incremented for every sfx played on the voice
+  int priority;
+  Uint32 started;     // allocation order, used to steal the oldest voice
+} AudioVoice;
+
+// the first PX_AUDIO_CHANNELS are played directly, the rest is the sfx pool
+AudioChannel channels[PX_AUDIO_VOICES];
+AudioVoice voice_info[PX_AUDIO_VOICES];     // only touched by the game thread
+SDL_atomic_t voice_ended[PX_AUDIO_VOICES];  // last generation the mixer finished
+Uint32 voice_sequence;
+int audio_voices;
+AudioSongPlayer audio_song;                 // only touched by the audio thread
 Sint8 audio_noise[PX_AUDIO_NOISE];
+Uint32 audio_notes[PX_AUDIO_NOTES];
 float mixing_frequency;
+int audio_samples, audio_adaptive, audio_paused;
+int audio_running;                    // a sound card or the disk writer consumes commands
+// single producer / single consumer rings between the game and audio thread
+AudioCommand audio_commands[PX_AUDIO_COMMANDS];
+SDL_atomic_t audio_command_head, audio_command_tail;
+int audio_releases[PX_AUDIO_RELEASES];
+SDL_atomic_t audio_release_head, audio_release_tail;
+int audio_deadline;                   // buffer duration in microseconds
+Uint64 audio_last_callback;           // only touched by the audio thread
+SDL_atomic_t audio_mix_time, audio_mix_max, audio_grow;
+// disk writer replacing the sound card, see -audioout
+typedef struct AudioWriter {
+  FILE *file;
+  int wav;            // write a WAV header, otherwise raw PCM
+  Uint32 bytes;       // PCM bytes written so far
+  Uint8 *buffer;      // ring between the mixer and the writer thread
+  int head, tail, done;
+  SDL_mutex *mutex;
+  SDL_cond *cond;
+  SDL_Thread *thread;
+  SDL_Thread *timer;  // mixes in real time unless running in lockstep
+  SDL_atomic_t quit;
+  int lockstep;       // mix one tick worth of samples after every update
+  int fraction;       // samples * tick rate left over by the last tick
+} AudioWriter;
+AudioWriter audio_writer;
+// music clock: positions at the start of the last mixed buffer, guarded by a sequence counter
+SDL_atomic_t audio_clock_sequence, audio_clock_time, audio_clock_running;
+SDL_atomic_t audio_positions[PX_AUDIO_VOICES], audio_events[PX_AUDIO_VOICES];
+// markers reached by the mixer, drained by the game thread
+typedef struct AudioMarker {
+  int channel;        // channel number or sfx handle
+  int id;
+  int position;       // channel position in samples
+} AudioMarker;
+AudioMarker audio_markers[PX_AUDIO_MARKERS];
+SDL_atomic_t audio_marker_head, audio_marker_tail;
+// mixing statistics, only written by the audio thread
+SDL_atomic_t audio_histogram[PX_AUDIO_HISTOGRAM];  // callbacks per mix time bucket
+SDL_atomic_t audio_callbacks, audio_late, audio_mix_min, audio_mix_total;
 
 // Input
 enum {
@@ -151,13 +348,166 @@ typedef struct Input {
 
 Input inputs[PX_NUM_CONTROLLERS];
 
+// Callbacks, cached as registry references
+enum {
+  PX_CALLBACK_INIT, PX_CALLBACK_UPDATE, PX_CALLBACK_DRAW, PX_CALLBACK_TICK, PX_CALLBACK_IDLE, PX_CALLBACK_MARKER,
+  PX_CALLBACK_LAST
+};
+
+int callbacks[PX_CALLBACK_LAST];
+
+// Coroutines started with pixl.spawn(), waiting in a timing wheel
+typedef struct Task {
+  int ref;            // the coroutine, LUA_NOREF for unused tasks
+  Uint32 wake;        // tick to resume it
+  int next;           // next task in the same slot or the free list
+} Task;
+
+typedef struct Scheduler {
+  Task *tasks;
+  int capacity, count, free;
+  int heads[PX_SCHED_SLOTS], tails[PX_SCHED_SLOTS];
+  Uint32 tick;        // first tick which wasn't run yet
+} Scheduler;
+
+Scheduler scheduler;
+
+// Garbage collection
+typedef struct GCStats {
+  int active;         // a cycle is in progress
+  size_t threshold;   // memory which starts the next cycle
+  int cycles;
+  Uint64 time, max_time, total_time;  // performance counter ticks
+} GCStats;
+
+GCStats gc_stats;
+
+// Lua allocator, slabs are carved into blocks of one size class
+typedef struct MemSlab {
+  struct MemSlab *next;
+} MemSlab;
+
+typedef struct MemPool {
+  void *free[PX_ALLOC_CLASSES];   // free lists, linked through the blocks
+  MemSlab *slabs;
+  size_t live, peak, slab_bytes;
+  Uint64 allocations, frees;
+  int frame_allocations, last_frame_allocations;
+  size_t frame_bytes, last_frame_bytes;
+  lua_State *L;   // its stopped collector is restarted when live passes limit
+  size_t limit;
+} MemPool;
+
+MemPool mem_pool;
+
+// Frame timings
+enum {
+  PX_STAGE_EVENTS,    // events and audio housekeeping
+  PX_STAGE_UPDATE,    // tick(), update() and idle()
+  PX_STAGE_GC,
+  PX_STAGE_DRAW,
+  PX_STAGE_UPLOAD,    // screen to texture, including the overlay
+  PX_STAGE_PRESENT,
+  PX_STAGE_TOTAL,
+  PX_STAGE_LAST
+};
+
+static const char *stage_names[PX_STAGE_LAST] = {
+  "events", "update", "gc", "draw", "upload", "present", "total"
+};
+
+typedef struct FrameStats {
+  Uint64 start, mark;
+  int current, count;
+  Uint64 times[PX_FRAME_HISTORY][PX_STAGE_LAST];  // performance counter ticks
+} FrameStats;
+
+FrameStats frame_stats;
+SDL_bool show_stats;
+Uint8 stats_backup[PX_STATS_COLUMNS * 8][PX_STATS_ROWS * 8];  // screen under the overlay
+
+// Sampling profiler, see f_profile()
+typedef struct ProfileFunction {
+  const void *key;      // source of Lua functions, the function itself for C functions, only compared
+  int line;             // line where the function is defined
+  int self, total;
+  int sample;           // last sample counted in total
+  char *label;
+} ProfileFunction;
+
+typedef struct ProfileLine {
+  int function, line;   // function == -1 for unused slots
+  int count;
+} ProfileLine;
+
+typedef struct ProfileStack {
+  Uint32 hash;
+  int depth;            // 0 for unused slots
+  int count;
+  int functions[PX_PROFILE_DEPTH];  // outermost first
+} ProfileStack;
+
+typedef struct Profile {
+  SDL_atomic_t active;
+  SDL_TimerID timer;
+  int interval;         // milliseconds between samples
+  int samples, dropped;
+  ProfileFunction *functions;
+  ProfileLine *lines;
+  ProfileStack *stacks;
+} Profile;
+
+Profile profile;
+
 // assorted stuff
 int running;
 int fullscreen;
+int headless;       // no window, ticks run as fast as possible
+int frame_limit;    // number of ticks to run or 0
+Uint32 tick_count;
+int tick_rate;
+Uint64 tick_accumulator;  // performance counter ticks * tick_rate
+double tick_time;   // seconds of all ticks so far, the clock of headless runs
 Uint32 seed;
 int margc;
 char **margv;
 
+// Byte buffer userdata, slices point into the data of their parent
+typedef struct Buffer {
+  Uint8 *data;
+  size_t size;
+} Buffer;
+
+// Entity store, every field is an array of floats or ints
+typedef struct EntityField {
+  char name[PX_ENTITY_NAME];
+  SDL_bool integer;
+  union { float *f; Sint32 *i; } data;
+} EntityField;
+
+typedef struct Entities {
+  int capacity, count, field_count;
+  int x, y, vx, vy;   // field indices used by the bulk operations, -1 if missing
+  int *hits;          // scratch space for each_in_rect()
+  EntityField fields[PX_ENTITY_FIELDS];
+} Entities;
+
+// Archive, see -archive
+typedef struct ArchiveEntry {
+  const Uint8 *data;  // inside the mapping
+  Uint32 size;        // stored size
+  Uint32 raw_size;    // same as size for uncompressed entries
+} ArchiveEntry;
+
+typedef struct Archive {
+  Uint8 *base;        // mapped (or on Windows loaded) file
+  size_t size;
+  ArchiveEntry *entries;
+  int count;
+} Archive;
+
+Archive archive;
+
 // UDP networking
 int socket_fd;
 
@@ -352,6 +702,29 @@ static void px_randomseed(Uint32 s) {
   for (i = 0; i < 1024; ++i) (void)px_rand();
 }
 
+static void px_write32(Uint8 *data, Uint32 value) {
+  data[0] = value & 0xFF; data[1] = (value >> 8) & 0xFF; data[2] = (value >> 16) & 0xFF; data[3] = value >> 24;
+}
+
+static Uint32 px_read32(const Uint8 *data) {
+  return (Uint32)data[0] | ((Uint32)data[1] << 8) | ((Uint32)data[2] << 16) | ((Uint32)data[3] << 24);
+}
+
+// pushes the contents of a file
+static void px_read_file(lua_State *L, const char *filename) {
+  luaL_Buffer buffer;
+  FILE *file = fopen(filename, "rb");
+  size_t size;
+  if (!file) luaL_error(L, "cannot open %s", filename);
+  luaL_buffinit(L, &buffer);
+  do {
+    size = fread(luaL_prepbuffer(&buffer), 1, LUAL_BUFFERSIZE, file);
+    luaL_addsize(&buffer, size);
+  } while (size == LUAL_BUFFERSIZE);
+  fclose(file);
+  luaL_pushresult(&buffer);
+}
+
 static int px_check_parm(const char *name) {
   int i;
   for (i = 1; i < margc; ++i) if (!SDL_strcmp(name, margv[i])) return i;
@@ -366,6 +739,708 @@ static const char *px_check_arg(const char *name) {
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Lua Allocator
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Small blocks are served from per size class free lists, everything else
+// goes to the system allocator. Lua tells the size of a block when it's
+// freed or resized, so the blocks need no header. Slabs are kept until the
+// pool is freed.
+
+static void *px_pool_alloc(MemPool *pool, size_t size) {
+  int i = (int)((size - 1) / PX_ALLOC_GRANULE);
+  size_t block = (size_t)(i + 1) * PX_ALLOC_GRANULE, offset;
+  void *p;
+  ++pool->allocations;
+  ++pool->frame_allocations;
+  pool->frame_bytes += size;
+  if (i >= PX_ALLOC_CLASSES) return SDL_malloc(size);
+  if (!pool->free[i]) {
+    // carve a new slab into a free list
+    MemSlab *slab = (MemSlab*)SDL_malloc(PX_ALLOC_SLAB);
+    if (!slab) return NULL;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_bytes += PX_ALLOC_SLAB;
+    for (offset = PX_ALLOC_GRANULE; offset + block <= PX_ALLOC_SLAB; offset += block) {
+      p = (Uint8*)slab + offset;
+      *(void**)p = pool->free[i];
+      pool->free[i] = p;
+    }
+  }
+  p = pool->free[i];
+  pool->free[i] = *(void**)p;
+  return p;
+}
+
+static void px_pool_free(MemPool *pool, void *p, size_t size) {
+  int i = (int)((size - 1) / PX_ALLOC_GRANULE);
+  ++pool->frees;
+  if (i >= PX_ALLOC_CLASSES) { SDL_free(p); return; }
+  *(void**)p = pool->free[i];
+  pool->free[i] = p;
+}
+
+// lua_Alloc with a MemPool as user data
+static void *px_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  MemPool *pool = (MemPool*)ud;
+  void *p;
+  if (!ptr) osize = 0; // osize is the type of the new object then
+  if (nsize == 0) {
+    if (ptr) px_pool_free(pool, ptr, osize);
+    pool->live -= osize;
+    return NULL;
+  }
+  if (ptr) {
+    // same size class, or both too large for the slabs
+    if (nsize <= PX_ALLOC_CLASSES * PX_ALLOC_GRANULE && (osize - 1) / PX_ALLOC_GRANULE == (nsize - 1) / PX_ALLOC_GRANULE) p = ptr;
+    else if (osize > PX_ALLOC_CLASSES * PX_ALLOC_GRANULE && nsize > PX_ALLOC_CLASSES * PX_ALLOC_GRANULE) p = SDL_realloc(ptr, nsize);
+    else {
+      p = px_pool_alloc(pool, nsize);
+      if (!p && nsize < osize) {
+        // shrinking must not fail, a block of the full class size can go onto the free list later;
+        // without any memory left the old block is kept, it is larger than the class needs
+        p = SDL_malloc((nsize + PX_ALLOC_GRANULE - 1) / PX_ALLOC_GRANULE * PX_ALLOC_GRANULE);
+        if (!p) p = ptr;
+      }
+      if (!p) return NULL;
+      if (p != ptr) {
+        SDL_memcpy(p, ptr, SDL_min(osize, nsize));
+        px_pool_free(pool, ptr, osize);
+      }
+    }
+  }
+  else p = px_pool_alloc(pool, nsize);
+  if (!p) return NULL;
+  pool->live += nsize - osize;
+  if (pool->live > pool->peak) pool->peak = pool->live;
+  // safety valve for frames allocating faster than the idle time collects, restarting only sets
+  // flags, Lua runs the steps at its next safe point
+  if (pool->limit && pool->live > pool->limit) {
+    pool->limit = 0;
+    lua_gc(pool->L, LUA_GCRESTART, 0);
+  }
+  return p;
+}
+
+// call after lua_close()
+static void px_pool_destroy(MemPool *pool) {
+  MemSlab *slab;
+  while (pool->slabs) {
+    slab = pool->slabs;
+    pool->slabs = slab->next;
+    SDL_free(slab);
+  }
+  SDL_zerop(pool);
+}
+
+static void px_pool_next_frame(MemPool *pool) {
+  pool->last_frame_allocations = pool->frame_allocations;
+  pool->last_frame_bytes = pool->frame_bytes;
+  pool->frame_allocations = 0;
+  pool->frame_bytes = 0;
+}
+
+static int px_panic(lua_State *L) {
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+  return 0;
+}
+
+static int f_memstats(lua_State *L) {
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, (lua_Integer)mem_pool.live); lua_setfield(L, -2, "live");
+  lua_pushinteger(L, (lua_Integer)mem_pool.peak); lua_setfield(L, -2, "peak");
+  lua_pushinteger(L, (lua_Integer)mem_pool.slab_bytes); lua_setfield(L, -2, "slabs");
+  lua_pushinteger(L, (lua_Integer)mem_pool.allocations); lua_setfield(L, -2, "allocations");
+  lua_pushinteger(L, (lua_Integer)mem_pool.frees); lua_setfield(L, -2, "frees");
+  lua_pushinteger(L, mem_pool.last_frame_allocations); lua_setfield(L, -2, "frameallocations");
+  lua_pushinteger(L, (lua_Integer)mem_pool.last_frame_bytes); lua_setfield(L, -2, "framebytes");
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Callbacks
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static const char *callback_names[] = { "init", "update", "draw", "tick", "idle", "marker", NULL };
+
+static int px_find_callback(lua_State *L, int idx) {
+  const char *name;
+  int i;
+  if (lua_type(L, idx) != LUA_TSTRING) return -1;
+  name = lua_tostring(L, idx);
+  for (i = 0; callback_names[i]; ++i) if (!SDL_strcmp(name, callback_names[i])) return i;
+  return -1;
+}
+
+// replaces the cached callback with the value on top of the stack
+static void px_set_callback(lua_State *L, int callback) {
+  luaL_unref(L, LUA_REGISTRYINDEX, callbacks[callback]);
+  callbacks[callback] = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// calls a callback with the `nargs` arguments on the stack, returns 0 if it isn't defined
+static int px_call_callback(lua_State *L, int callback, int nargs) {
+  if (lua_rawgeti(L, LUA_REGISTRYINDEX, callbacks[callback]) != LUA_TFUNCTION) {
+    lua_pop(L, nargs + 1);
+    return 0;
+  }
+  lua_insert(L, -(nargs + 1));
+  lua_call(L, nargs, 0);
+  return 1;
+}
+
+// callback globals never live in _G, so every assignment reaches __newindex
+static int px_globals_index(lua_State *L) {
+  int callback = px_find_callback(L, 2);
+  if (callback < 0) return 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, callbacks[callback]);
+  return 1;
+}
+
+static int px_globals_newindex(lua_State *L) {
+  int callback = px_find_callback(L, 2);
+  if (callback < 0) { lua_rawset(L, 1); return 0; }
+  px_set_callback(L, callback);
+  return 0;
+}
+
+static int f_callbacks(lua_State *L) {
+  int i;
+  if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TTABLE);
+  for (i = 0; i < PX_CALLBACK_LAST; ++i) {
+    if (lua_istable(L, 1)) {
+      // only the given callbacks are replaced, false removes one
+      if (lua_getfield(L, 1, callback_names[i]) == LUA_TNIL) { lua_pop(L, 1); continue; }
+      if (!lua_toboolean(L, -1)) { lua_pop(L, 1); lua_pushnil(L); }
+      px_set_callback(L, i);
+    }
+    else {
+      // without a table callbacks stored with rawset() are moved into the cache
+      lua_pushglobaltable(L);
+      lua_pushstring(L, callback_names[i]);
+      if (lua_rawget(L, -2) != LUA_TNIL) {
+        px_set_callback(L, i);
+        lua_pushstring(L, callback_names[i]); lua_pushnil(L); lua_rawset(L, -3);
+      }
+      else lua_pop(L, 1);
+      lua_pop(L, 1);
+    }
+  }
+  return 0;
+}
+
+static void px_init_callbacks(lua_State *L) {
+  int i;
+  for (i = 0; i < PX_CALLBACK_LAST; ++i) callbacks[i] = LUA_NOREF;
+  lua_pushglobaltable(L);
+  lua_createtable(L, 0, 2);
+  lua_pushcfunction(L, px_globals_index); lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, px_globals_newindex); lua_setfield(L, -2, "__newindex");
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Coroutine Scheduler
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Every tick only the slot of the timing wheel for that tick is visited,
+// tasks sleeping longer than PX_SCHED_SLOTS ticks stay in their slot for
+// another round. Waiting coroutines cost nothing until they are due.
+
+static void px_scheduler_init() {
+  int i;
+  SDL_zero(scheduler);
+  scheduler.free = -1;
+  for (i = 0; i < PX_SCHED_SLOTS; ++i) scheduler.heads[i] = scheduler.tails[i] = -1;
+}
+
+// appends a task to the slot of its wake tick
+static void px_scheduler_insert(int i) {
+  int slot = (int)(scheduler.tasks[i].wake & (PX_SCHED_SLOTS - 1));
+  scheduler.tasks[i].next = -1;
+  if (scheduler.tails[slot] < 0) scheduler.heads[slot] = i;
+  else scheduler.tasks[scheduler.tails[slot]].next = i;
+  scheduler.tails[slot] = i;
+}
+
+static void px_scheduler_release(lua_State *L, int i) {
+  luaL_unref(L, LUA_REGISTRYINDEX, scheduler.tasks[i].ref);
+  scheduler.tasks[i].ref = LUA_NOREF;
+  scheduler.tasks[i].next = scheduler.free;
+  scheduler.free = i;
+  --scheduler.count;
+}
+
+// resumes all coroutines due at `tick`, runs straight after update()
+static void px_scheduler_run(lua_State *L, Uint32 tick) {
+  lua_State *co;
+  Task *task;
+  int i, next, status, nargs, slot = (int)(tick & (PX_SCHED_SLOTS - 1));
+  lua_Integer ticks;
+  // tasks spawned or waiting from now on are due next tick at the earliest
+  scheduler.tick = tick + 1;
+  i = scheduler.heads[slot];
+  scheduler.heads[slot] = scheduler.tails[slot] = -1;
+  for (; i >= 0; i = next) {
+    task = &scheduler.tasks[i];
+    next = task->next;
+    if ((Sint32)(task->wake - tick) > 0) { px_scheduler_insert(i); continue; } // another round
+    lua_rawgeti(L, LUA_REGISTRYINDEX, task->ref);
+    co = lua_tothread(L, -1);
+    // a new task has its function and arguments on the stack
+    nargs = lua_status(co) == LUA_OK ? lua_gettop(co) - 1 : 0;
+    status = lua_resume(co, L, nargs);
+    if (status == LUA_YIELD) {
+      // wait() and sleep() yield the scheduler and the ticks, a plain yield waits one tick
+      ticks = lua_gettop(co) == 2 && lua_touserdata(co, 1) == &scheduler ? lua_tointeger(co, 2) : 1;
+      lua_settop(co, 0);
+      task = &scheduler.tasks[i]; // spawn() may have moved the tasks
+      task->wake = tick + (Uint32)ticks;
+      px_scheduler_insert(i);
+    }
+    else {
+      // finished or failed, errors are raised with the traceback of the coroutine
+      if (status != LUA_OK) luaL_traceback(L, co, lua_tostring(co, -1), 0);
+      px_scheduler_release(L, i);
+      if (status != LUA_OK) lua_error(L);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+static int f_spawn(lua_State *L) {
+  lua_State *co;
+  Task *tasks;
+  int i, capacity, n = lua_gettop(L);
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  if (scheduler.free < 0) {
+    capacity = scheduler.capacity ? scheduler.capacity * 2 : 64;
+    tasks = (Task*)SDL_realloc(scheduler.tasks, sizeof(Task) * capacity);
+    if (!tasks) return luaL_error(L, "out of memory");
+    for (i = capacity - 1; i >= scheduler.capacity; --i) {
+      tasks[i].ref = LUA_NOREF;
+      tasks[i].next = scheduler.free;
+      scheduler.free = i;
+    }
+    scheduler.tasks = tasks;
+    scheduler.capacity = capacity;
+  }
+  // the function and its arguments wait on the stack of the new coroutine
+  co = lua_newthread(L);
+  if (!lua_checkstack(co, n)) return luaL_error(L, "too many arguments to spawn");
+  lua_insert(L, 1);
+  lua_xmove(L, co, n);
+  i = scheduler.free;
+  scheduler.free = scheduler.tasks[i].next;
+  ++scheduler.count;
+  lua_pushvalue(L, 1);
+  scheduler.tasks[i].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  scheduler.tasks[i].wake = scheduler.tick;
+  px_scheduler_insert(i);
+  return 1;
+}
+
+static int px_scheduler_yield(lua_State *L, lua_Integer ticks) {
+  lua_settop(L, 0);
+  lua_pushlightuserdata(L, &scheduler);
+  lua_pushinteger(L, ticks);
+  return lua_yield(L, 2);
+}
+
+static int f_wait(lua_State *L) {
+  lua_Integer frames = luaL_optinteger(L, 1, 1);
+  luaL_argcheck(L, frames > 0 && frames <= INT_MAX, 1, "invalid number of frames");
+  return px_scheduler_yield(L, frames);
+}
+
+static int f_sleep(lua_State *L) {
+  lua_Number seconds = luaL_checknumber(L, 1);
+  luaL_argcheck(L, seconds >= 0 && seconds * tick_rate <= INT_MAX, 1, "invalid time");
+  return px_scheduler_yield(L, SDL_max((lua_Integer)SDL_ceil(seconds * tick_rate), 1));
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Buffers
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static const char *buffer_types[] = { "u8", "i8", "u16", "i16", "u32", "i32", "i64", NULL };
+static const int buffer_widths[] = { 1, 1, 2, 2, 4, 4, 8 };
+
+// accepts a string or a buffer
+static const char *_check_data(lua_State *L, int idx, size_t *size) {
+  Buffer *buffer = (Buffer*)luaL_testudata(L, idx, PX_BUFFER_TYPE);
+  if (!buffer) return luaL_checklstring(L, idx, size);
+  *size = buffer->size;
+  return (const char*)buffer->data;
+}
+
+// checks that `length` bytes at the 0 based offset given at `idx` are inside the buffer
+static size_t _check_offset(lua_State *L, int idx, const Buffer *buffer, size_t length) {
+  lua_Integer offset = luaL_checkinteger(L, idx);
+  luaL_argcheck(L, offset >= 0 && (size_t)offset <= buffer->size && length <= buffer->size - (size_t)offset, idx, "out of range");
+  return (size_t)offset;
+}
+
+static Buffer *px_new_buffer(lua_State *L, size_t size) {
+  Buffer *buffer = (Buffer*)lua_newuserdata(L, sizeof(Buffer) + size);
+  buffer->data = (Uint8*)(buffer + 1);
+  buffer->size = size;
+  luaL_setmetatable(L, PX_BUFFER_TYPE);
+  return buffer;
+}
+
+static int f_buffer(lua_State *L) {
+  size_t size;
+  const char *data;
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    lua_Integer length = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, length >= 0 && length <= INT_MAX, 1, "invalid size");
+    SDL_memset(px_new_buffer(L, (size_t)length)->data, 0, (size_t)length);
+  }
+  else {
+    data = _check_data(L, 1, &size);
+    SDL_memcpy(px_new_buffer(L, size)->data, data, size);
+  }
+  return 1;
+}
+
+static int f_buffer_len(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)((Buffer*)luaL_checkudata(L, 1, PX_BUFFER_TYPE))->size);
+  return 1;
+}
+
+// values are stored little endian
+static int f_buffer_get(lua_State *L) {
+  Buffer *buffer = (Buffer*)luaL_checkudata(L, 1, PX_BUFFER_TYPE);
+  int i, type = luaL_checkoption(L, 3, "u8", buffer_types);
+  int width = buffer_widths[type];
+  const Uint8 *p = buffer->data + _check_offset(L, 2, buffer, width);
+  Uint64 value = 0;
+  for (i = 0; i < width; ++i) value |= (Uint64)p[i] << (i * 8);
+  if ((type & 1) && width < 8 && (value >> (width * 8 - 1))) value |= ~(Uint64)0 << (width * 8); // sign extension
+  lua_pushinteger(L, (lua_Integer)value);
+  return 1;
+}
+
+static int f_buffer_set(lua_State *L) {
+  Buffer *buffer = (Buffer*)luaL_checkudata(L, 1, PX_BUFFER_TYPE);
+  Uint64 value = (Uint64)luaL_checkinteger(L, 3);
+  int i, width = buffer_widths[luaL_checkoption(L, 4, "u8", buffer_types)];
+  Uint8 *p = buffer->data + _check_offset(L, 2, buffer, width);
+  for (i = 0; i < width; ++i) p[i] = (Uint8)(value >> (i * 8));
+  return 0;
+}
+
+// a view on a part of the buffer, it keeps the buffer alive
+static int f_buffer_slice(lua_State *L) {
+  Buffer *buffer = (Buffer*)luaL_checkudata(L, 1, PX_BUFFER_TYPE), *slice;
+  size_t offset = _check_offset(L, 2, buffer, 0);
+  size_t length = (size_t)luaL_optinteger(L, 3, (lua_Integer)(buffer->size - offset));
+  luaL_argcheck(L, length <= buffer->size - offset, 3, "out of range");
+  slice = (Buffer*)lua_newuserdata(L, sizeof(Buffer));
+  slice->data = buffer->data + offset;
+  slice->size = length;
+  luaL_setmetatable(L, PX_BUFFER_TYPE);
+  lua_pushvalue(L, 1); lua_setuservalue(L, -2);
+  return 1;
+}
+
+static int f_buffer_fill(lua_State *L) {
+  Buffer *buffer = (Buffer*)luaL_checkudata(L, 1, PX_BUFFER_TYPE);
+  int value = (int)luaL_checkinteger(L, 2);
+  size_t offset = lua_isnoneornil(L, 3) ? 0 : _check_offset(L, 3, buffer, 0);
+  size_t length = (size_t)luaL_optinteger(L, 4, (lua_Integer)(buffer->size - offset));
+  luaL_argcheck(L, length <= buffer->size - offset, 4, "out of range");
+  SDL_memset(buffer->data + offset, value & 0xFF, length);
+  return 0;
+}
+
+// copies a whole string or buffer to the offset, source and target may overlap
+static int f_buffer_copy(lua_State *L) {
+  Buffer *buffer = (Buffer*)luaL_checkudata(L, 1, PX_BUFFER_TYPE);
+  size_t size;
+  const char *data = _check_data(L, 2, &size);
+  size_t offset = lua_isnoneornil(L, 3) ? 0 : _check_offset(L, 3, buffer, size);
+  luaL_argcheck(L, size <= buffer->size - offset, 2, "does not fit into the buffer");
+  SDL_memmove(buffer->data + offset, data, size);
+  return 0;
+}
+
+static int f_buffer_tostring(lua_State *L) {
+  Buffer *buffer = (Buffer*)luaL_checkudata(L, 1, PX_BUFFER_TYPE);
+  size_t offset = lua_isnoneornil(L, 2) ? 0 : _check_offset(L, 2, buffer, 0);
+  size_t length = (size_t)luaL_optinteger(L, 3, (lua_Integer)(buffer->size - offset));
+  luaL_argcheck(L, length <= buffer->size - offset, 3, "out of range");
+  lua_pushlstring(L, (const char*)buffer->data + offset, length);
+  return 1;
+}
+
+static const luaL_Reg buffer_methods[] = {
+  {"__len", f_buffer_len},
+  {"size", f_buffer_len},
+  {"get", f_buffer_get},
+  {"set", f_buffer_set},
+  {"slice", f_buffer_slice},
+  {"fill", f_buffer_fill},
+  {"copy", f_buffer_copy},
+  {"tostring", f_buffer_tostring},
+  {NULL, NULL}
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Entities
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Entities are stored as structure of arrays, so the bulk operations are
+// plain loops over the fields which the compiler can vectorize. The arrays
+// are padded to a multiple of 4 entities, the kernels work on blocks of 4
+// and select with arithmetic instead of branches for the same reason.
+// Indices are 1 based like Lua tables.
+
+static void px_entities_integrate(float *PX_RESTRICT p, const float *PX_RESTRICT v, float dt, int count) {
+  int i, j;
+  for (i = 0; i < count; i += 4) for (j = 0; j < 4; ++j) p[i + j] += v[i + j] * dt;
+}
+
+// reflects positions outside of 0 - size back inside, velocities leaving the area change their sign
+static void px_entities_bounce(float *PX_RESTRICT p, float *PX_RESTRICT v, float size, int count) {
+  int i, j, low, high;
+  float q, s;
+  for (i = 0; i < count; i += 4) {
+    for (j = 0; j < 4; ++j) {
+      q = p[i + j]; s = v[i + j];
+      low = q < 0.0f; high = q > size;
+      v[i + j] = s * (float)(1 - 2 * ((low & (s < 0.0f)) | (high & (s > 0.0f))));
+      p[i + j] = q * (float)(1 - 2 * (low | high)) + size * (float)(2 * high);
+    }
+  }
+}
+
+static void px_entities_in_rect(const float *PX_RESTRICT x, const float *PX_RESTRICT y, int *PX_RESTRICT hits, float x0, float y0, float x1, float y1, int count) {
+  int i, j;
+  for (i = 0; i < count; i += 4) {
+    for (j = 0; j < 4; ++j) hits[i + j] = (x[i + j] >= x0) & (x[i + j] < x1) & (y[i + j] >= y0) & (y[i + j] < y1);
+  }
+}
+
+static int _check_entity(lua_State *L, int idx, const Entities *entities) {
+  lua_Integer i = luaL_checkinteger(L, idx);
+  luaL_argcheck(L, i >= 1 && i <= entities->count, idx, "invalid entity");
+  return (int)i - 1;
+}
+
+static EntityField *_check_field(lua_State *L, int idx, Entities *entities) {
+  const char *name = luaL_checkstring(L, idx);
+  int i;
+  for (i = 0; i < entities->field_count; ++i) {
+    if (!SDL_strcmp(name, entities->fields[i].name)) return &entities->fields[i];
+  }
+  luaL_argerror(L, idx, lua_pushfstring(L, "unknown field " LUA_QS, name));
+  return NULL;
+}
+
+// the bulk operations need float fields named x, y, vx and vy
+static Entities *_check_movable(lua_State *L) {
+  Entities *entities = (Entities*)luaL_checkudata(L, 1, PX_ENTITIES_TYPE);
+  if (entities->x < 0 || entities->y < 0 || entities->vx < 0 || entities->vy < 0) luaL_error(L, "the entities have no float fields x, y, vx and vy");
+  return entities;
+}
+
+static void px_entity_field(lua_State *L, Entities *entities, const char *name, const char *type) {
+  EntityField *field = &entities->fields[entities->field_count];
+  int i;
+  if (entities->field_count == PX_ENTITY_FIELDS) luaL_error(L, "too many fields");
+  if (SDL_strlen(name) >= PX_ENTITY_NAME) luaL_error(L, "field name " LUA_QS " is too long", name);
+  for (i = 0; i < entities->field_count; ++i) {
+    if (!SDL_strcmp(name, entities->fields[i].name)) luaL_error(L, "duplicate field " LUA_QS, name);
+  }
+  if (SDL_strcmp(type, "float") && SDL_strcmp(type, "int")) luaL_error(L, "invalid type " LUA_QS " of field " LUA_QS, type, name);
+  SDL_memcpy(field->name, name, SDL_strlen(name) + 1);
+  field->integer = !SDL_strcmp(type, "int");
+  ++entities->field_count;
+}
+
+static int f_entities(lua_State *L) {
+  Entities *entities, header;
+  Uint8 *data;
+  lua_Integer capacity = luaL_checkinteger(L, 1);
+  int i, stride;
+  luaL_argcheck(L, capacity > 0 && capacity <= 16 * 1024 * 1024, 1, "invalid capacity");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  // names in the list are floats, name = "float" or "int" gives the type
+  SDL_zero(header);
+  for (i = 1; lua_rawgeti(L, 2, i) != LUA_TNIL; ++i) {
+    if (lua_type(L, -1) != LUA_TSTRING) luaL_argerror(L, 2, "field names must be strings");
+    px_entity_field(L, &header, lua_tostring(L, -1), "float");
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {
+    if (lua_type(L, -2) == LUA_TSTRING) px_entity_field(L, &header, lua_tostring(L, -2), luaL_checkstring(L, -1));
+    lua_pop(L, 1);
+  }
+  luaL_argcheck(L, header.field_count > 0, 2, "no fields");
+
+  // all arrays follow the header, each 16 byte aligned
+  stride = (int)((capacity + 3) & ~3);
+  entities = (Entities*)lua_newuserdata(L, sizeof(Entities) + 15 + (size_t)stride * sizeof(Sint32) * (header.field_count + 1));
+  *entities = header;
+  entities->capacity = (int)capacity;
+  data = (Uint8*)(((uintptr_t)(entities + 1) + 15) & ~(uintptr_t)15);
+  SDL_memset(data, 0, (size_t)stride * sizeof(Sint32) * (header.field_count + 1)); // the padding is processed, too
+  for (i = 0; i < entities->field_count; ++i) {
+    entities->fields[i].data.i = (Sint32*)data;
+    data += stride * sizeof(Sint32);
+  }
+  entities->hits = (int*)data;
+  entities->x = entities->y = entities->vx = entities->vy = -1;
+  for (i = 0; i < entities->field_count; ++i) {
+    if (entities->fields[i].integer) continue;
+    if (!SDL_strcmp(entities->fields[i].name, "x")) entities->x = i;
+    else if (!SDL_strcmp(entities->fields[i].name, "y")) entities->y = i;
+    else if (!SDL_strcmp(entities->fields[i].name, "vx")) entities->vx = i;
+    else if (!SDL_strcmp(entities->fields[i].name, "vy")) entities->vy = i;
+  }
+  luaL_setmetatable(L, PX_ENTITIES_TYPE);
+  return 1;
+}
+
+static int f_entities_len(lua_State *L) {
+  lua_pushinteger(L, ((Entities*)luaL_checkudata(L, 1, PX_ENTITIES_TYPE))->count);
+  return 1;
+}
+
+static void px_entity_set(lua_State *L, EntityField *field, int i, int idx) {
+  if (field->integer) field->data.i[i] = (Sint32)luaL_checkinteger(L, idx);
+  else field->data.f[i] = (float)luaL_checknumber(L, idx);
+}
+
+// adds an entity with all fields 0 or taken from the given table, returns its index
+static int f_entities_add(lua_State *L) {
+  Entities *entities = (Entities*)luaL_checkudata(L, 1, PX_ENTITIES_TYPE);
+  int f, i = entities->count;
+  if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+  if (i == entities->capacity) luaL_error(L, "entity store is full");
+  for (f = 0; f < entities->field_count; ++f) {
+    entities->fields[f].data.i[i] = 0; // 0.0f has the same bits
+    if (lua_istable(L, 2)) {
+      if (lua_getfield(L, 2, entities->fields[f].name) != LUA_TNIL) px_entity_set(L, &entities->fields[f], i, -1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pushinteger(L, ++entities->count);
+  return 1;
+}
+
+// the last entity takes the place of the removed one
+static int f_entities_remove(lua_State *L) {
+  Entities *entities = (Entities*)luaL_checkudata(L, 1, PX_ENTITIES_TYPE);
+  int f, i = _check_entity(L, 2, entities), last = --entities->count;
+  for (f = 0; f < entities->field_count; ++f) entities->fields[f].data.i[i] = entities->fields[f].data.i[last];
+  return 0;
+}
+
+static int f_entities_clear(lua_State *L) {
+  ((Entities*)luaL_checkudata(L, 1, PX_ENTITIES_TYPE))->count = 0;
+  return 0;
+}
+
+static int f_entities_get(lua_State *L) {
+  Entities *entities = (Entities*)luaL_checkudata(L, 1, PX_ENTITIES_TYPE);
+  int i = _check_entity(L, 2, entities);
+  EntityField *field = _check_field(L, 3, entities);
+  if (field->integer) lua_pushinteger(L, field->data.i[i]);
+  else lua_pushnumber(L, field->data.f[i]);
+  return 1;
+}
+
+static int f_entities_set(lua_State *L) {
+  Entities *entities = (Entities*)luaL_checkudata(L, 1, PX_ENTITIES_TYPE);
+  int i = _check_entity(L, 2, entities);
+  px_entity_set(L, _check_field(L, 3, entities), i, 4);
+  return 0;
+}
+
+static int f_entities_integrate(lua_State *L) {
+  Entities *entities = _check_movable(L);
+  float dt = (float)luaL_checknumber(L, 2);
+  px_entities_integrate(entities->fields[entities->x].data.f, entities->fields[entities->vx].data.f, dt, entities->count);
+  px_entities_integrate(entities->fields[entities->y].data.f, entities->fields[entities->vy].data.f, dt, entities->count);
+  return 0;
+}
+
+// keeps the entities inside the area 0, 0 - w, h
+static int f_entities_bounce(lua_State *L) {
+  Entities *entities = _check_movable(L);
+  float w = (float)luaL_checknumber(L, 2), h = (float)luaL_checknumber(L, 3);
+  px_entities_bounce(entities->fields[entities->x].data.f, entities->fields[entities->vx].data.f, w, entities->count);
+  px_entities_bounce(entities->fields[entities->y].data.f, entities->fields[entities->vy].data.f, h, entities->count);
+  return 0;
+}
+
+// calls fn(index) for every entity inside the rectangle, returns the number of hits;
+// the hits are collected before the first call
+static int f_entities_each_in_rect(lua_State *L) {
+  Entities *entities = _check_movable(L);
+  float x0 = (float)luaL_checknumber(L, 2), y0 = (float)luaL_checknumber(L, 3);
+  float x1 = x0 + (float)luaL_checknumber(L, 4), y1 = y0 + (float)luaL_checknumber(L, 5);
+  int i, hits = 0, count = entities->count, *list = entities->hits;
+  if (!lua_isnoneornil(L, 6)) luaL_checktype(L, 6, LUA_TFUNCTION);
+  px_entities_in_rect(entities->fields[entities->x].data.f, entities->fields[entities->y].data.f, list, x0, y0, x1, y1, count);
+  // compact the flags into a list of indices
+  for (i = 0; i < count; ++i) {
+    if (list[i]) list[hits++] = i + 1;
+  }
+  // the callbacks may query this store again, which reuses the scratch space
+  if (hits && lua_isfunction(L, 6)) {
+    list = (int*)SDL_memcpy(lua_newuserdata(L, sizeof(int) * hits), list, sizeof(int) * hits);
+  }
+  for (i = 0; i < hits && lua_isfunction(L, 6); ++i) {
+    lua_pushvalue(L, 6);
+    lua_pushinteger(L, list[i]);
+    lua_call(L, 1, 0);
+  }
+  lua_pushinteger(L, hits);
+  return 1;
+}
+
+static const luaL_Reg entities_methods[] = {
+  {"__len", f_entities_len},
+  {"add", f_entities_add},
+  {"remove", f_entities_remove},
+  {"clear", f_entities_clear},
+  {"get", f_entities_get},
+  {"set", f_entities_set},
+  {"integrate", f_entities_integrate},
+  {"bounce", f_entities_bounce},
+  {"each_in_rect", f_entities_each_in_rect},
+  {NULL, NULL}
+};
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Video Drawing Primitives
@@ -496,7 +1571,7 @@ static int f_sprite(lua_State *L) {
   int x, y, w, h;
   int x0 = (int)luaL_checknumber(L, 1);
   int y0 = (int)luaL_checknumber(L, 2);
-  const char *data = luaL_checklstring(L, 3, &length);
+  const char *data = _check_data(L, 3, &length);
   int transparent = (int)luaL_optinteger(L, 4, -1);
   switch (length) {
   case 64: w = h = 8; break;
@@ -540,41 +1615,332 @@ static int f_print(lua_State *L) {
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-static void mml_reset_channel(AudioChannel *channel);
+static const AudioProgram *mml_compile_cached(lua_State *L, int idx);
+static void px_audio_run_commands();
 
-static int f_play(lua_State *L) {
-  AudioChannel *channel;
-  int i = (int)luaL_checkinteger(L, 1);
-  const char *str = luaL_checkstring(L, 2);
-  luaL_argcheck(L, i >= 0 && i < PX_AUDIO_CHANNELS, 1, "invalid channel");
-  if (audio_device) {
-    SDL_LockAudioDevice(audio_device);
-    channel = &channels[i];
-    mml_reset_channel(channel);
-    channel->source = channel->in = SDL_strdup(str);
-    channel->looping = lua_toboolean(L, 3);
-    SDL_UnlockAudioDevice(audio_device);
+// releases the programs the mixer is done with
+static void px_audio_collect(lua_State *L) {
+  int tail = SDL_AtomicGet(&audio_release_tail);
+  int head = SDL_AtomicGet(&audio_release_head);
+  SDL_MemoryBarrierAcquire(); // the refs up to head are written
+  for (; tail != head; tail = (tail + 1) % PX_AUDIO_RELEASES) {
+    luaL_unref(L, LUA_REGISTRYINDEX, audio_releases[tail]);
   }
-  return 0;
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&audio_release_tail, tail);
 }
 
-static int f_stop(lua_State *L) {
-  int i = (int)luaL_checkinteger(L, 1);
-  luaL_argcheck(L, i >= 0 && i < PX_AUDIO_CHANNELS, 1, "invalid channel");
-  if (audio_device) {
-    SDL_LockAudioDevice(audio_device);
-    mml_reset_channel(&channels[i]);
-    SDL_UnlockAudioDevice(audio_device);
+// hands a command over to the mixer, which picks it up with the next buffer
+static void px_audio_push(lua_State *L, const AudioCommand *command) {
+  int head = SDL_AtomicGet(&audio_command_head);
+  int next = (head + 1) % PX_AUDIO_COMMANDS;
+  px_audio_collect(L);
+  if (next == SDL_AtomicGet(&audio_command_tail) && audio_writer.lockstep) {
+    // the lockstep mixer runs on this thread, apply the queued commands now instead of waiting for it
+    px_audio_run_commands();
+    px_audio_collect(L);
+  }
+  while (next == SDL_AtomicGet(&audio_command_tail)) SDL_Delay(1); // queue is full
+  SDL_MemoryBarrierAcquire(); // the mixer is done with the slot
+  audio_commands[head] = *command;
+  // the command has to be visible before the new head, weakly ordered CPUs (ARM) may reorder the stores otherwise
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&audio_command_head, next);
+}
+
+static void px_audio_send(lua_State *L, int type, int channel, int value) {
+  AudioCommand command;
+  SDL_zero(command);
+  command.type = type;
+  command.channel = channel;
+  command.ref = LUA_NOREF;
+  command.value = value;
+  px_audio_push(L, &command);
+}
+
+static int f_play(lua_State *L) {
+  AudioCommand command;
+  int i = (int)luaL_checkinteger(L, 1);
+  luaL_checkstring(L, 2);
+  luaL_argcheck(L, i >= 0 && i < PX_AUDIO_CHANNELS, 1, "invalid channel");
+  SDL_zero(command);
+  command.type = PX_AUDIO_PLAY;
+  command.channel = i;
+  // the loop flag has to be read before the compiled program is pushed
+  command.value = lua_toboolean(L, 3);
+  command.program = mml_compile_cached(L, 2);
+  command.value = command.value && command.program->length > 0;
+  if (audio_running) {
+    // the reference keeps the program alive until the mixer releases it
+    command.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    px_audio_push(L, &command);
+  }
+  return 0;
+}
+
+static int f_sample(lua_State *L) {
+  AudioCommand command;
+  size_t length;
+  int i = (int)luaL_checkinteger(L, 1);
+  const char *data = _check_data(L, 2, &length);
+  lua_Number rate = luaL_optnumber(L, 3, mixing_frequency);
+  int bits = (int)luaL_optinteger(L, 5, 8);
+  luaL_argcheck(L, i >= 0 && i < PX_AUDIO_CHANNELS, 1, "invalid channel");
+  luaL_argcheck(L, rate > 0.0 && rate <= 192000.0, 3, "invalid rate");
+  luaL_argcheck(L, bits == 8 || bits == 16, 5, "invalid bits");
+  luaL_argcheck(L, bits == 8 || !((uintptr_t)data & 1), 2, "16 bit data at an odd offset"); // buffer slices
+  SDL_zero(command);
+  command.type = PX_AUDIO_PLAY_SAMPLE;
+  command.channel = i;
+  command.sample.data = data;
+  command.sample.length = (int)(length / (bits / 8));
+  command.sample.bits = bits;
+  command.sample.step = (Uint32)(rate * 65536.0 / mixing_frequency);
+  command.value = lua_toboolean(L, 4) && command.sample.length > 0;
+  if (audio_running) {
+    // the data is not copied, the reference pins the string or buffer until the mixer releases it
+    lua_pushvalue(L, 2);
+    command.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    px_audio_push(L, &command);
   }
   return 0;
 }
 
+// picks a free pool voice or steals the oldest one with the lowest priority
+static int px_audio_allocate_voice(int priority) {
+  AudioVoice *voice, *best = NULL;
+  int i, found = -1;
+  for (i = PX_AUDIO_CHANNELS; i < audio_voices; ++i) {
+    voice = &voice_info[i];
+    if (SDL_AtomicGet(&voice_ended[i]) == voice->generation) return i;
+    if (voice->priority > priority) continue;
+    if (!best || voice->priority < best->priority || (voice->priority == best->priority && (Sint32)(voice->started - best->started) < 0)) {
+      best = voice;
+      found = i;
+    }
+  }
+  return found;
+}
+
+static int f_sfx(lua_State *L) {
+  AudioCommand command;
+  AudioVoice *voice;
+  int i, priority = (int)luaL_optinteger(L, 2, 0);
+  luaL_checkstring(L, 1);
+  SDL_zero(command);
+  command.type = PX_AUDIO_PLAY;
+  command.value = lua_toboolean(L, 3);
+  command.program = mml_compile_cached(L, 1);
+  command.value = command.value && command.program->length > 0;
+  if (!audio_running || (i = px_audio_allocate_voice(priority)) < 0) return 0;
+  voice = &voice_info[i];
+  voice->generation = (voice->generation + 1) & 0x7FFFFF;
+  if (!voice->generation) voice->generation = 1;
+  voice->priority = priority;
+  voice->started = ++voice_sequence;
+  command.channel = i;
+  command.generation = voice->generation;
+  command.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  px_audio_push(L, &command);
+  lua_pushinteger(L, ((lua_Integer)voice->generation << 8) | i);
+  return 1;
+}
+
+// accepts a channel number or a sfx handle, returns -1 for outdated handles
+static int _check_voice(lua_State *L, int idx) {
+  lua_Integer handle = luaL_checkinteger(L, idx);
+  int i = (int)(handle & 0xFF);
+  if (handle >= 0 && handle < PX_AUDIO_CHANNELS) return (int)handle;
+  luaL_argcheck(L, handle > 0 && i >= PX_AUDIO_CHANNELS && i < audio_voices, idx, "invalid channel");
+  return (handle >> 8) == voice_info[i].generation ? i : -1;
+}
+
+static int f_stop(lua_State *L) {
+  int i = _check_voice(L, 1);
+  if (audio_running && i >= 0) px_audio_send(L, PX_AUDIO_STOP, i, 0);
+  return 0;
+}
+
 static int f_pause(lua_State *L) {
-  int pause = lua_toboolean(L, 1);
-  if (audio_device) SDL_PauseAudioDevice(audio_device, pause);
+  if (audio_running) px_audio_send(L, PX_AUDIO_PAUSE, 0, lua_toboolean(L, 1));
+  return 0;
+}
+
+static int f_volume(lua_State *L) {
+  int i = _check_voice(L, 1);
+  lua_Number volume = luaL_checknumber(L, 2);
+  luaL_argcheck(L, volume >= 0.0 && volume <= 1.0, 2, "invalid volume");
+  if (audio_running && i >= 0) px_audio_send(L, PX_AUDIO_SET_VOLUME, i, (int)(volume * PX_AUDIO_VOLUME));
+  return 0;
+}
+
+static int f_pan(lua_State *L) {
+  int i = _check_voice(L, 1);
+  lua_Number pan = luaL_checknumber(L, 2);
+  luaL_argcheck(L, pan >= -1.0 && pan <= 1.0, 2, "invalid pan");
+  if (audio_running && i >= 0) px_audio_send(L, PX_AUDIO_SET_PAN, i, (int)(pan * PX_AUDIO_VOLUME));
+  return 0;
+}
+
+static void px_audio_mix(AudioChannel *mix_channels, int count, AudioSongPlayer *player, Uint8 *stream, int len);
+
+static int f_render(lua_State *L) {
+  AudioChannel channel;
+  luaL_Buffer buffer;
+  const AudioProgram *program;
+  lua_Number seconds;
+  int length, size;
+  luaL_checkstring(L, 1);
+  seconds = luaL_optnumber(L, 2, -1.0);
+  luaL_argcheck(L, lua_isnoneornil(L, 2) || (seconds >= 0.0 && seconds <= 3600.0), 2, "invalid length");
+  program = mml_compile_cached(L, 1);
+  if (seconds < 0.0) seconds = (lua_Number)program->length / mixing_frequency;
+  length = (int)(seconds * mixing_frequency);
+  // render on a private channel, looping when more than one pass is wanted
+  SDL_zero(channel);
+  channel.program = program;
+  channel.ref = LUA_NOREF;
+  channel.voice = -1;
+  channel.volume = PX_AUDIO_VOLUME;
+  channel.looping = length > program->length && program->length > 0;
+  size = length * 2 * (int)sizeof(Sint16);
+  px_audio_mix(&channel, 1, NULL, (Uint8*)luaL_buffinitsize(L, &buffer, size), size);
+  luaL_pushresultsize(&buffer, size);
+  return 1;
+}
+
+static int f_position(lua_State *L) {
+  int i = _check_voice(L, 1), sequence, position, events, running;
+  Uint32 elapsed;
+  if (!audio_running || i < 0) return 0;
+  // retry while the audio thread updates the clock
+  do {
+    sequence = SDL_AtomicGet(&audio_clock_sequence);
+    elapsed = (Uint32)SDL_GetPerformanceCounter() - (Uint32)SDL_AtomicGet(&audio_clock_time);
+    position = SDL_AtomicGet(&audio_positions[i]);
+    events = SDL_AtomicGet(&audio_events[i]);
+    running = SDL_AtomicGet(&audio_clock_running);
+  } while ((sequence & 1) || sequence != SDL_AtomicGet(&audio_clock_sequence));
+  if (position < 0) return 0;
+  // advance by the time passed since the buffer was mixed, at most one buffer
+  if (running) position += (int)SDL_min((double)elapsed * mixing_frequency / (double)SDL_GetPerformanceFrequency(), (double)audio_samples);
+  lua_pushinteger(L, position);
+  lua_pushinteger(L, events);
+  return 2;
+}
+
+// calls marker(channel, id, position) for every marker the mixer has reached
+static void px_audio_markers(lua_State *L) {
+  AudioMarker *marker;
+  int tail = SDL_AtomicGet(&audio_marker_tail);
+  while (tail != SDL_AtomicGet(&audio_marker_head)) {
+    SDL_MemoryBarrierAcquire();
+    marker = &audio_markers[tail];
+    lua_pushinteger(L, marker->channel);
+    lua_pushinteger(L, marker->id);
+    lua_pushinteger(L, marker->position);
+    px_call_callback(L, PX_CALLBACK_MARKER, 3);
+    tail = (tail + 1) % PX_AUDIO_MARKERS;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&audio_marker_tail, tail);
+  }
+}
+
+// mix times in microseconds are sorted into 4 buckets per power of two
+static int px_audio_bucket(int us) {
+  int bits = 0;
+  if (us < 4) return SDL_max(us, 0);
+  while (us >> (bits + 1)) ++bits;
+  if (bits > PX_AUDIO_HISTOGRAM / 4) return PX_AUDIO_HISTOGRAM - 1;
+  return (bits - 1) * 4 + ((us >> (bits - 2)) & 3);
+}
+
+// lower bound of a bucket in microseconds
+static int px_audio_bucket_time(int bucket) {
+  if (bucket < 4) return bucket;
+  return (4 + (bucket & 3)) << (bucket / 4 - 1);
+}
+
+static int f_audiostats(lua_State *L) {
+  int i, count = 0, callbacks = SDL_AtomicGet(&audio_callbacks), p99 = 0;
+  if (lua_toboolean(L, 1) && audio_running) px_audio_send(L, PX_AUDIO_RESET_STATS, 0, 0);
+  for (i = 0; i < PX_AUDIO_HISTOGRAM; ++i) {
+    count += SDL_AtomicGet(&audio_histogram[i]);
+    if ((Sint64)count * 100 >= (Sint64)callbacks * 99) { p99 = px_audio_bucket_time(i + 1); break; }
+  }
+  lua_createtable(L, 0, 6);
+  lua_pushnumber(L, callbacks ? (lua_Number)SDL_AtomicGet(&audio_mix_min) / 1000000.0 : 0.0); lua_setfield(L, -2, "min");
+  lua_pushnumber(L, callbacks ? (lua_Number)(Uint32)SDL_AtomicGet(&audio_mix_total) / callbacks / 1000000.0 : 0.0); lua_setfield(L, -2, "avg");
+  lua_pushnumber(L, callbacks ? (lua_Number)p99 / 1000000.0 : 0.0); lua_setfield(L, -2, "p99");
+  lua_pushinteger(L, audio_running ? audio_samples : 0); lua_setfield(L, -2, "samples");
+  lua_pushinteger(L, callbacks); lua_setfield(L, -2, "callbacks");
+  lua_pushinteger(L, SDL_AtomicGet(&audio_late)); lua_setfield(L, -2, "late");
+  return 1;
+}
+
+static void mml_pack_song(lua_State *L, int idx);
+static const AudioSong *mml_compile_song(lua_State *L, int idx);
+
+static int f_song(lua_State *L) {
+  luaL_argcheck(L, lua_istable(L, 1) || lua_isstring(L, 1), 1, "table or string expected");
+  mml_compile_song(L, 1);
+  return 1;
+}
+
+static int f_packsong(lua_State *L) {
+  size_t size;
+  luaL_Buffer buffer;
+  const char *source;
+  char *dest;
+  int dest_size, compress = lua_toboolean(L, 2);
+  luaL_checktype(L, 1, LUA_TTABLE);
+  mml_pack_song(L, 1);
+  if (!compress) return 1;
+  // the compressed form starts with its own header and the original size
+  source = lua_tolstring(L, -1, &size);
+  dest_size = LZ4_compressBound((int)size);
+  dest = luaL_buffinitsize(L, &buffer, 8 + dest_size);
+  SDL_memcpy(dest, "PXSZ", 4);
+  dest[4] = (char)(size & 0xFF); dest[5] = (char)((size >> 8) & 0xFF);
+  dest[6] = (char)((size >> 16) & 0xFF); dest[7] = (char)((size >> 24) & 0xFF);
+  dest_size = LZ4_compress_default(source, dest + 8, (int)size, dest_size);
+  if (!dest_size) luaL_error(L, "compression failed");
+  luaL_pushresultsize(&buffer, 8 + dest_size);
+  return 1;
+}
+
+static int f_playsong(lua_State *L) {
+  AudioCommand command;
+  SDL_zero(command);
+  command.type = PX_AUDIO_PLAY_SONG;
+  command.song = (const AudioSong*)luaL_checkudata(L, 1, PX_SONG_TYPE);
+  command.value = lua_toboolean(L, 2);
+  if (audio_running) {
+    // the song keeps its patterns alive through its user value
+    lua_pushvalue(L, 1);
+    command.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    px_audio_push(L, &command);
+  }
   return 0;
 }
 
+static int f_stopsong(lua_State *L) {
+  if (audio_running) px_audio_send(L, PX_AUDIO_STOP_SONG, 0, 0);
+  return 0;
+}
+
+static int f_audioconfig(lua_State *L) {
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, audio_running ? (lua_Integer)mixing_frequency : 0); lua_setfield(L, -2, "frequency");
+  lua_pushinteger(L, audio_running ? audio_samples : 0); lua_setfield(L, -2, "samples");
+  lua_pushnumber(L, audio_running ? (lua_Number)audio_deadline / 1000000.0 : 0.0); lua_setfield(L, -2, "latency");
+  lua_pushboolean(L, audio_adaptive); lua_setfield(L, -2, "adaptive");
+  lua_pushinteger(L, audio_voices); lua_setfield(L, -2, "voices");
+  lua_pushnumber(L, (lua_Number)SDL_AtomicGet(&audio_mix_time) / 1000000.0); lua_setfield(L, -2, "mixtime");
+  lua_pushnumber(L, (lua_Number)SDL_AtomicGet(&audio_mix_max) / 1000000.0); lua_setfield(L, -2, "maxmixtime");
+  return 1;
+}
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -583,9 +1949,17 @@ static int f_pause(lua_State *L) {
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+static const char *button_names[] = { "A", "B", "X", "Y", "LEFT", "RIGHT", "UP", "DOWN", "START", NULL };
+
+// accepts a mask of the button constants or, much slower, a button name
 static int _check_button(lua_State *L) {
-  static const char *options[] = { "A", "B", "X", "Y", "LEFT", "RIGHT", "UP", "DOWN", "START", NULL };
-  return 1 << luaL_checkoption(L, 1, NULL, options);
+  lua_Integer mask;
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    mask = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, mask > 0 && mask < (1 << PX_BUTTON_LAST), 1, "invalid button");
+    return (int)mask;
+  }
+  return 1 << luaL_checkoption(L, 1, NULL, button_names);
 }
 
 static int _check_controller(lua_State *L) {
@@ -604,6 +1978,16 @@ static int f_btnp(lua_State *L) {
   return 1;
 }
 
+static int f_buttons(lua_State *L) {
+  Input *input;
+  int controller = (int)luaL_optinteger(L, 1, 0);
+  luaL_argcheck(L, controller >= 0 && controller < PX_NUM_CONTROLLERS, 1, "invalid controller");
+  input = &inputs[controller];
+  lua_pushinteger(L, input->down);
+  lua_pushinteger(L, input->pressed);
+  return 2;
+}
+
 static int f_mouse(lua_State *L) {
   Input *input = &inputs[_check_controller(L)];
   lua_pushinteger(L, input->mouse.x + translation.x);
@@ -621,7 +2005,9 @@ static int f_mouse(lua_State *L) {
 
 static int f_clipboard(lua_State *L) {
   if (lua_gettop(L) > 0) {
-    const char *text = luaL_checkstring(L, 1);
+    size_t length;
+    const char *text = _check_data(L, 1, &length);
+    text = lua_pushlstring(L, text, length); // SDL wants a terminated string
     if (SDL_SetClipboardText(text)) luaL_error(L, "SDL_SetClipboardText() failed: %s", SDL_GetError());
     lua_pushstring(L, text);
     return 1;
@@ -632,6 +2018,59 @@ static int f_clipboard(lua_State *L) {
   }
 }
 
+static int px_compare_ticks(const void *a, const void *b) {
+  Uint64 x = *(const Uint64*)a, y = *(const Uint64*)b;
+  return x < y ? -1 : x > y;
+}
+
+// fills `out` with the 50th, 95th and 99th percentile and the maximum of a stage
+static void px_frame_percentiles(int stage, Uint64 *out) {
+  Uint64 times[PX_FRAME_HISTORY];
+  int i, count = frame_stats.count;
+  if (!count) { SDL_memset(out, 0, sizeof(Uint64) * 4); return; }
+  for (i = 0; i < count; ++i) times[i] = frame_stats.times[i][stage];
+  SDL_qsort(times, count, sizeof(Uint64), px_compare_ticks);
+  out[0] = times[(count - 1) * 50 / 100];
+  out[1] = times[(count - 1) * 95 / 100];
+  out[2] = times[(count - 1) * 99 / 100];
+  out[3] = times[count - 1];
+}
+
+// the last completed frame
+static const Uint64 *px_frame_last() {
+  return frame_stats.times[(frame_stats.current + PX_FRAME_HISTORY - 1) % PX_FRAME_HISTORY];
+}
+
+static int f_stats(lua_State *L) {
+  double frequency = (double)SDL_GetPerformanceFrequency();
+  Uint64 percentiles[4];
+  int i;
+  lua_createtable(L, 0, PX_STAGE_LAST + 1);
+  lua_pushinteger(L, frame_stats.count); lua_setfield(L, -2, "frames");
+  for (i = 0; i < PX_STAGE_LAST; ++i) {
+    px_frame_percentiles(i, percentiles);
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, frame_stats.count ? (lua_Number)px_frame_last()[i] / frequency : 0.0); lua_setfield(L, -2, "last");
+    lua_pushnumber(L, (lua_Number)percentiles[0] / frequency); lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, (lua_Number)percentiles[1] / frequency); lua_setfield(L, -2, "p95");
+    lua_pushnumber(L, (lua_Number)percentiles[2] / frequency); lua_setfield(L, -2, "p99");
+    lua_pushnumber(L, (lua_Number)percentiles[3] / frequency); lua_setfield(L, -2, "max");
+    lua_setfield(L, -2, stage_names[i]);
+  }
+  return 1;
+}
+
+static int f_gcstats(lua_State *L) {
+  double frequency = (double)SDL_GetPerformanceFrequency();
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, (lua_Number)gc_stats.time / frequency); lua_setfield(L, -2, "time");
+  lua_pushnumber(L, (lua_Number)gc_stats.max_time / frequency); lua_setfield(L, -2, "maxtime");
+  lua_pushnumber(L, (lua_Number)gc_stats.total_time / frequency); lua_setfield(L, -2, "totaltime");
+  lua_pushinteger(L, gc_stats.cycles); lua_setfield(L, -2, "cycles");
+  lua_pushinteger(L, (lua_Integer)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0)); lua_setfield(L, -2, "memory");
+  return 1;
+}
+
 static int f_randomseed(lua_State *L) {
   if (lua_gettop(L) > 0) {
     Uint32 x = (Uint32)luaL_checkinteger(L, 1);
@@ -670,8 +2109,21 @@ static int f_title(lua_State *L) {
 }
 
 static int f_time(lua_State *L) {
-  Uint32 ticks = SDL_GetTicks();
-  lua_pushnumber(L, (lua_Number)ticks / 1000.0);
+  // headless runs are reproducible, so their clock only advances with the ticks
+  lua_pushnumber(L, headless ? (lua_Number)tick_time : (lua_Number)SDL_GetTicks() / 1000.0);
+  return 1;
+}
+
+static int f_tickrate(lua_State *L) {
+  if (!lua_isnoneornil(L, 1)) {
+    lua_Integer rate = luaL_checkinteger(L, 1);
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    luaL_argcheck(L, rate >= 1 && rate <= PX_MAX_TICK_RATE, 1, "invalid tick rate");
+    // pending updates are kept, the time gathered towards the next one is rescaled
+    tick_accumulator = tick_accumulator / frequency * frequency + tick_accumulator % frequency * (Uint64)rate / (Uint64)tick_rate;
+    tick_rate = (int)rate;
+  }
+  lua_pushinteger(L, tick_rate);
   return 1;
 }
 
@@ -697,9 +2149,18 @@ static int f_resolution(lua_State *L) {
 static int f_compress(lua_State *L) {
   size_t source_size;
   luaL_Buffer buffer;
-  const char *source = luaL_checklstring(L, 1, &source_size);
+  const char *source = _check_data(L, 1, &source_size);
+  Buffer *target = (Buffer*)luaL_testudata(L, 2, PX_BUFFER_TYPE);
   int dest_size = LZ4_compressBound((int)source_size);
-  char *dest = luaL_buffinitsize(L, &buffer, dest_size);
+  char *dest;
+  // compress into the given buffer, returns the compressed size
+  if (target) {
+    dest_size = LZ4_compress_default(source, (char*)target->data, (int)source_size, (int)SDL_min(target->size, INT_MAX));
+    if (!dest_size) luaL_error(L, "compression failed");
+    lua_pushinteger(L, dest_size);
+    return 1;
+  }
+  dest = luaL_buffinitsize(L, &buffer, dest_size);
   dest_size = LZ4_compress_default(source, dest, (int)source_size, dest_size);
   if (!dest_size) luaL_error(L, "compression failed");
   luaL_pushresultsize(&buffer, dest_size);
@@ -709,9 +2170,19 @@ static int f_compress(lua_State *L) {
 static int f_decompress(lua_State *L) {
   size_t source_size;
   luaL_Buffer buffer;
-  const char *source = luaL_checklstring(L, 1, &source_size);
-  int dest_size = (int)luaL_optinteger(L, 2, 64 * 1024);
-  char *dest = luaL_buffinitsize(L, &buffer, dest_size);
+  const char *source = _check_data(L, 1, &source_size);
+  Buffer *target = (Buffer*)luaL_testudata(L, 2, PX_BUFFER_TYPE);
+  int dest_size;
+  char *dest;
+  // decompress into the given buffer, returns the decompressed size
+  if (target) {
+    dest_size = LZ4_decompress_safe(source, (char*)target->data, (int)source_size, (int)SDL_min(target->size, INT_MAX));
+    if (dest_size < 0) luaL_error(L, "decompression failed");
+    lua_pushinteger(L, dest_size);
+    return 1;
+  }
+  dest_size = (int)luaL_optinteger(L, 2, 64 * 1024);
+  dest = luaL_buffinitsize(L, &buffer, dest_size);
   dest_size = LZ4_decompress_safe(source, dest, (int)source_size, dest_size);
   if (!dest_size) luaL_error(L, "decompression failed");
   luaL_pushresultsize(&buffer, dest_size);
@@ -755,6 +2226,7 @@ static int f_recv(lua_State *L) {
   int datalen = 1024 * 4;
   socklen_t sinlen;
   luaL_Buffer buffer;
+  Buffer *target = (Buffer*)luaL_testudata(L, 1, PX_BUFFER_TYPE);
   char *data;
   struct timeval tv;
   fd_set set;
@@ -770,11 +2242,13 @@ static int f_recv(lua_State *L) {
   sin.sin_port = 0;
   sin.sin_addr.s_addr = INADDR_ANY;
   sinlen = sizeof(sin);
-  // receive
-  data = luaL_buffinitsize(L, &buffer, datalen);
+  // receive, into the given buffer it returns the size instead of a string
+  if (target) { datalen = (int)SDL_min(target->size, INT_MAX); data = (char*)target->data; }
+  else data = luaL_buffinitsize(L, &buffer, datalen);
   datalen = recvfrom(socket_fd, data, datalen, 0, (struct sockaddr*)&sin, &sinlen);
   if (datalen < 0) return 0;
-  luaL_pushresultsize(&buffer, datalen);
+  if (target) lua_pushinteger(L, datalen);
+  else luaL_pushresultsize(&buffer, datalen);
   lua_pushinteger(L, ntohl(sin.sin_addr.s_addr));
   lua_pushinteger(L, ntohs(sin.sin_port));
   return 3;
@@ -784,7 +2258,7 @@ static int f_send(lua_State *L) {
   struct sockaddr_in sin;
   size_t datalen;
   int sent;
-  const char *data = luaL_checklstring(L, 1, &datalen);
+  const char *data = _check_data(L, 1, &datalen);
   Uint32 host = (Uint32)luaL_checkinteger(L, 2);
   Uint16 port = (Uint16)luaL_checkinteger(L, 3);
   // prepare addr
@@ -818,6 +2292,421 @@ static int f_resolve(lua_State *L) {
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Archives
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// An archive starts with "PXA1" and the number of entries (u32), followed by
+// the table of contents: name length (u16), name, offset (u32), stored size
+// (u32) and original size (u32) of every entry. Entries are LZ4 blocks, or
+// stored as they are if the stored and original size are the same.
+
+// returns the index of the named entry or -1
+static int px_archive_find(lua_State *L, const char *name) {
+  int i = -1;
+  if (!archive.base) return -1;
+  lua_getfield(L, LUA_REGISTRYINDEX, PX_ARCHIVE_INDEX);
+  if (lua_getfield(L, -1, name) == LUA_TNUMBER) i = (int)lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  return i;
+}
+
+// pushes the data of an entry, decompressing it if needed
+static void px_archive_read(lua_State *L, int i) {
+  ArchiveEntry *entry = &archive.entries[i];
+  luaL_Buffer buffer;
+  if (entry->size == entry->raw_size) { lua_pushlstring(L, (const char*)entry->data, entry->size); return; }
+  if (LZ4_decompress_safe((const char*)entry->data, luaL_buffinitsize(L, &buffer, entry->raw_size), (int)entry->size, (int)entry->raw_size) != (int)entry->raw_size) {
+    luaL_error(L, "archive entry %d is corrupt", i);
+  }
+  luaL_pushresultsize(&buffer, entry->raw_size);
+}
+
+// package.searchers entry loading modules from the archive
+static int px_archive_searcher(lua_State *L) {
+  const char *name = luaL_gsub(L, luaL_checkstring(L, 1), ".", "/");
+  const char *path = lua_pushfstring(L, "%s.lua", name);
+  int i = px_archive_find(L, path);
+  if (i < 0) i = px_archive_find(L, path = lua_pushfstring(L, "%s/init.lua", name));
+  if (i < 0) { lua_pushfstring(L, "\n\tno entry '%s.lua' in archive", name); return 1; }
+  px_archive_read(L, i);
+  lua_pushfstring(L, "@%s", path);
+  if (luaL_loadbufferx(L, lua_tostring(L, -2), lua_rawlen(L, -2), lua_tostring(L, -1), "bt")) lua_error(L);
+  lua_pushstring(L, path);
+  return 2;
+}
+
+static int f_asset(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  int i = px_archive_find(L, name);
+  if (i < 0) { lua_pushnil(L); return 1; }
+  // decompressed once on first access
+  lua_getfield(L, LUA_REGISTRYINDEX, PX_ARCHIVE_ASSETS);
+  if (lua_rawgeti(L, -1, i + 1) == LUA_TNIL) {
+    lua_pop(L, 1);
+    px_archive_read(L, i);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, i + 1);
+  }
+  return 1;
+}
+
+// maps the archive into memory and puts its searcher right after package.preload
+static void px_archive_open(lua_State *L, const char *filename) {
+  const Uint8 *p, *end;
+  Uint32 offset;
+  int i, name_length;
+#ifdef _WIN32
+  FILE *file = fopen(filename, "rb");
+  if (!file) luaL_error(L, "cannot open %s", filename);
+  fseek(file, 0, SEEK_END);
+  archive.size = (size_t)ftell(file);
+  fseek(file, 0, SEEK_SET);
+  archive.base = (Uint8*)SDL_malloc(archive.size ? archive.size : 1);
+  if (!archive.base || fread(archive.base, 1, archive.size, file) != archive.size) { fclose(file); luaL_error(L, "cannot read %s", filename); }
+  fclose(file);
+#else
+  struct stat info;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &info)) { if (fd >= 0) close(fd); luaL_error(L, "cannot open %s", filename); }
+  archive.size = (size_t)info.st_size;
+  archive.base = archive.size ? (Uint8*)mmap(NULL, archive.size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (archive.base == MAP_FAILED) archive.base = NULL;
+  if (!archive.base) luaL_error(L, "cannot map %s", filename);
+#endif // _WIN32
+
+  // read the table of contents
+  p = archive.base; end = p + archive.size;
+  if (archive.size < 8 || SDL_memcmp(p, "PXA1", 4)) luaL_error(L, "%s is no archive", filename);
+  archive.count = (int)px_read32(p + 4);
+  if (archive.count < 0 || (size_t)archive.count > archive.size / 14) luaL_error(L, "%s is corrupt", filename);
+  archive.entries = (ArchiveEntry*)SDL_malloc(sizeof(ArchiveEntry) * (archive.count ? archive.count : 1));
+  if (!archive.entries) luaL_error(L, "out of memory");
+  lua_createtable(L, 0, archive.count);
+  for (i = 0, p += 8; i < archive.count; ++i) {
+    if (end - p < 2) luaL_error(L, "%s is corrupt", filename);
+    name_length = p[0] | (p[1] << 8);
+    if (end - p - 14 < name_length) luaL_error(L, "%s is corrupt", filename);
+    lua_pushlstring(L, (const char*)p + 2, name_length);
+    p += 2 + name_length;
+    offset = px_read32(p);
+    archive.entries[i].size = px_read32(p + 4);
+    archive.entries[i].raw_size = px_read32(p + 8);
+    archive.entries[i].data = archive.base + offset;
+    if (offset > archive.size || archive.entries[i].size > archive.size - offset || archive.entries[i].raw_size > PX_ARCHIVE_MAX_ENTRY) {
+      luaL_error(L, "%s is corrupt", filename);
+    }
+    lua_pushinteger(L, i);
+    lua_rawset(L, -3);
+    p += 12;
+  }
+  lua_setfield(L, LUA_REGISTRYINDEX, PX_ARCHIVE_INDEX);
+  lua_newtable(L); lua_setfield(L, LUA_REGISTRYINDEX, PX_ARCHIVE_ASSETS);
+
+  // modules in the archive are found before the file system is searched
+  lua_getglobal(L, "package"); lua_getfield(L, -1, "searchers");
+  for (i = (int)lua_rawlen(L, -1); i >= 2; --i) {
+    lua_rawgeti(L, -1, i);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushcfunction(L, px_archive_searcher);
+  lua_rawseti(L, -2, 2);
+  lua_pop(L, 2);
+}
+
+static void px_archive_close() {
+#ifdef _WIN32
+  SDL_free(archive.base);
+#else
+  if (archive.base) munmap(archive.base, archive.size);
+#endif // _WIN32
+  SDL_free(archive.entries);
+  SDL_zero(archive);
+}
+
+// -pack: writes the files given after the archive name into an archive
+static int px_pack(lua_State *L, const char *output) {
+  luaL_Buffer buffer;
+  FILE *file;
+  const char *data;
+  Uint8 header[12];
+  size_t size, length, written = 0;
+  Uint32 offset;
+  int i, first = px_check_parm("-pack") + 2, count;
+  for (count = 0; first + count < margc && margv[first + count][0] != '-'; ++count);
+  if (!count) luaL_error(L, "no files to pack");
+
+  // name, stored data and original size of every file, entries which
+  // don't get smaller are stored as they are
+  lua_settop(L, 0);
+  lua_newtable(L);
+  for (i = 0, offset = 8; i < count; ++i) {
+    luaL_gsub(L, margv[first + i], "\\", "/");
+    offset += 14 + (Uint32)lua_rawlen(L, -1);
+    lua_rawseti(L, 1, i * 3 + 1);
+    px_read_file(L, margv[first + i]);
+    data = lua_tolstring(L, -1, &size);
+    length = LZ4_compressBound((int)size);
+    length = LZ4_compress_default(data, luaL_buffinitsize(L, &buffer, length), (int)size, (int)length);
+    luaL_pushresultsize(&buffer, length);
+    if (length && length < size) lua_remove(L, -2);
+    else lua_pop(L, 1);
+    lua_rawseti(L, 1, i * 3 + 2);
+    lua_pushinteger(L, (lua_Integer)size); lua_rawseti(L, 1, i * 3 + 3);
+  }
+
+  // table of contents and data
+  file = fopen(output, "wb");
+  if (!file) luaL_error(L, "cannot open %s for writing", output);
+  SDL_memcpy(header, "PXA1", 4);
+  px_write32(header + 4, (Uint32)count);
+  written += fwrite(header, 1, 8, file);
+  for (i = 0; i < count; ++i) {
+    lua_rawgeti(L, 1, i * 3 + 1);
+    lua_rawgeti(L, 1, i * 3 + 2);
+    lua_rawgeti(L, 1, i * 3 + 3);
+    data = lua_tolstring(L, -3, &length);
+    size = lua_rawlen(L, -2);
+    header[0] = (Uint8)(length & 0xFF); header[1] = (Uint8)(length >> 8);
+    written += fwrite(header, 1, 2, file) + fwrite(data, 1, length, file);
+    px_write32(header, offset);
+    px_write32(header + 4, (Uint32)size);
+    px_write32(header + 8, (Uint32)lua_tointeger(L, -1));
+    written += fwrite(header, 1, 12, file);
+    offset += (Uint32)size;
+    lua_pop(L, 3);
+  }
+  for (i = 0; i < count; ++i) {
+    lua_rawgeti(L, 1, i * 3 + 2);
+    data = lua_tolstring(L, -1, &size);
+    written += fwrite(data, 1, size, file);
+    lua_pop(L, 1);
+  }
+  fclose(file);
+  printf("pack: %d files, %d bytes\n", count, (int)written);
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Profiler
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// A timer arms a count hook which samples the Lua call stack at the next
+// instruction. A permanent count hook would slow down every instruction of
+// the VM, this way the game runs at full speed between the samples. Time
+// spent in C functions or coroutines is added to the Lua code running next
+// in the main thread.
+
+// finds or adds the function of a stack frame, -1 if the table is full
+static int px_profile_function(lua_State *L, lua_Debug *ar) {
+  const void *key = ar->source;
+  Uint32 i, n;
+  ProfileFunction *f;
+  char label[128], *p;
+  // all C functions share the source "=[C]", they are told apart by their address
+  if (*ar->what == 'C') {
+    lua_getinfo(L, "f", ar);
+    key = lua_topointer(L, -1);
+    lua_pop(L, 1);
+  }
+  n = (Uint32)(((uintptr_t)key >> 3) ^ ((Uint32)ar->linedefined * 2654435761u));
+  for (i = 0; i < PX_PROFILE_FUNCTIONS; ++i, ++n) {
+    f = &profile.functions[n & (PX_PROFILE_FUNCTIONS - 1)];
+    if (f->key == key && f->line == ar->linedefined) return (int)(n & (PX_PROFILE_FUNCTIONS - 1));
+    if (f->key) continue;
+    // new function, the name is only looked up once
+    lua_getinfo(L, "n", ar);
+    if (*ar->what == 'm') SDL_snprintf(label, sizeof(label), "main chunk (%s)", ar->short_src);
+    else if (*ar->what == 'C') SDL_snprintf(label, sizeof(label), "%s [C]", ar->name ? ar->name : "function");
+    else SDL_snprintf(label, sizeof(label), "%s (%s:%d)", ar->name ? ar->name : "function", ar->short_src, ar->linedefined);
+    for (p = label; *p; ++p) if (*p == ';') *p = ':'; // the folded format separates frames with ';'
+    f->label = SDL_strdup(label);
+    if (!f->label) return -1;
+    f->key = key;
+    f->line = ar->linedefined;
+    return (int)(n & (PX_PROFILE_FUNCTIONS - 1));
+  }
+  return -1;
+}
+
+static void px_profile_hook(lua_State *L, lua_Debug *ar) {
+  lua_Debug frame;
+  ProfileLine *line;
+  ProfileStack *stack;
+  int functions[PX_PROFILE_DEPTH], depth, i;
+  Uint32 n, hash = 2166136261u;
+  (void)ar;
+
+  lua_sethook(L, NULL, 0, 0); // until the timer arms it again
+  if (!SDL_AtomicGet(&profile.active)) return;
+  ++profile.samples;
+  for (depth = 0; depth < PX_PROFILE_DEPTH && lua_getstack(L, depth, &frame); ++depth) {
+    lua_getinfo(L, "Sl", &frame);
+    i = px_profile_function(L, &frame);
+    if (i < 0) { ++profile.dropped; return; }
+    if (profile.functions[i].sample != profile.samples) {
+      profile.functions[i].sample = profile.samples;
+      ++profile.functions[i].total;
+    }
+    if (depth == 0) {
+      // self time is also counted per line
+      ++profile.functions[i].self;
+      for (n = 0; n < PX_PROFILE_LINES; ++n) {
+        line = &profile.lines[((Uint32)i * 31 + (Uint32)frame.currentline * 2654435761u + n) & (PX_PROFILE_LINES - 1)];
+        if (line->function < 0) { line->function = i; line->line = frame.currentline; }
+        if (line->function == i && line->line == frame.currentline) { ++line->count; break; }
+      }
+    }
+    functions[depth] = i;
+  }
+
+  // the complete stack for the folded report
+  if (!depth) return;
+  for (i = 0; i < depth; ++i) hash = (hash ^ (Uint32)functions[i]) * 16777619u;
+  for (n = 0; n < PX_PROFILE_STACKS; ++n) {
+    stack = &profile.stacks[(hash + n) & (PX_PROFILE_STACKS - 1)];
+    if (!stack->depth) {
+      stack->hash = hash;
+      stack->depth = depth;
+      for (i = 0; i < depth; ++i) stack->functions[i] = functions[depth - 1 - i];
+    }
+    if (stack->hash != hash || stack->depth != depth) continue;
+    for (i = 0; i < depth && stack->functions[i] == functions[depth - 1 - i]; ++i);
+    if (i == depth) { ++stack->count; return; }
+  }
+  ++profile.dropped;
+}
+
+// runs in the timer thread, lua_sethook() is fine to call from there
+static Uint32 px_profile_timer(Uint32 interval, void *param) {
+  if (SDL_AtomicGet(&profile.active)) lua_sethook((lua_State*)param, px_profile_hook, LUA_MASKCOUNT, 1);
+  return interval;
+}
+
+static void px_profile_stop(lua_State *L) {
+  if (!SDL_AtomicSet(&profile.active, 0)) return;
+  SDL_RemoveTimer(profile.timer);
+  lua_sethook(L, NULL, 0, 0);
+}
+
+static void px_profile_free() {
+  int i;
+  if (profile.functions) for (i = 0; i < PX_PROFILE_FUNCTIONS; ++i) SDL_free(profile.functions[i].label);
+  SDL_free(profile.functions);
+  SDL_free(profile.lines);
+  SDL_free(profile.stacks);
+  SDL_zero(profile);
+}
+
+static void px_profile_start(lua_State *L, int interval) {
+  int i;
+  px_profile_stop(L);
+  px_profile_free();
+  profile.functions = (ProfileFunction*)SDL_calloc(PX_PROFILE_FUNCTIONS, sizeof(ProfileFunction));
+  profile.lines = (ProfileLine*)SDL_calloc(PX_PROFILE_LINES, sizeof(ProfileLine));
+  profile.stacks = (ProfileStack*)SDL_calloc(PX_PROFILE_STACKS, sizeof(ProfileStack));
+  if (!profile.functions || !profile.lines || !profile.stacks) { px_profile_free(); luaL_error(L, "out of memory"); }
+  for (i = 0; i < PX_PROFILE_LINES; ++i) profile.lines[i].function = -1;
+  profile.interval = interval;
+  SDL_AtomicSet(&profile.active, 1);
+  profile.timer = SDL_AddTimer((Uint32)interval, px_profile_timer, L);
+  if (!profile.timer) { SDL_AtomicSet(&profile.active, 0); luaL_error(L, "SDL_AddTimer() failed: %s", SDL_GetError()); }
+}
+
+static int px_profile_compare_functions(const void *a, const void *b) {
+  return profile.functions[*(const int*)b].self - profile.functions[*(const int*)a].self;
+}
+
+static int px_profile_compare_lines(const void *a, const void *b) {
+  return profile.lines[*(const int*)b].count - profile.lines[*(const int*)a].count;
+}
+
+// pushes the flat report and the folded stacks
+static void px_profile_report(lua_State *L) {
+  luaL_Buffer buffer;
+  ProfileFunction *f;
+  ProfileLine *line;
+  ProfileStack *stack;
+  double total = profile.samples ? 100.0 / (double)profile.samples : 0.0;
+  char row[64];
+  int order[PX_PROFILE_LINES], count, i, j;
+  if (!profile.functions) { lua_pushliteral(L, ""); lua_pushliteral(L, ""); return; }
+
+  // flat report: functions by self samples, then the hottest lines
+  luaL_buffinit(L, &buffer);
+  lua_pushfstring(L, "%d samples every %d ms, %d dropped\n\n  self%%  total%%  samples  function\n", profile.samples, profile.interval, profile.dropped);
+  luaL_addvalue(&buffer);
+  for (count = i = 0; i < PX_PROFILE_FUNCTIONS; ++i) if (profile.functions[i].total) order[count++] = i;
+  SDL_qsort(order, count, sizeof(int), px_profile_compare_functions);
+  for (i = 0; i < count; ++i) {
+    f = &profile.functions[order[i]];
+    SDL_snprintf(row, sizeof(row), "%6.1f  %6.1f  %7d  ", f->self * total, f->total * total, f->self);
+    luaL_addstring(&buffer, row); luaL_addstring(&buffer, f->label); luaL_addchar(&buffer, '\n');
+  }
+  luaL_addstring(&buffer, "\n  self%  samples  line\n");
+  for (count = i = 0; i < PX_PROFILE_LINES; ++i) if (profile.lines[i].count) order[count++] = i;
+  SDL_qsort(order, count, sizeof(int), px_profile_compare_lines);
+  for (i = 0; i < count && i < PX_PROFILE_REPORT; ++i) {
+    line = &profile.lines[order[i]];
+    SDL_snprintf(row, sizeof(row), "%6.1f  %7d  %d in ", line->count * total, line->count, line->line);
+    luaL_addstring(&buffer, row); luaL_addstring(&buffer, profile.functions[line->function].label); luaL_addchar(&buffer, '\n');
+  }
+  luaL_pushresult(&buffer);
+
+  // folded stacks, one line per stack: "outer;inner count"
+  luaL_buffinit(L, &buffer);
+  for (i = 0; i < PX_PROFILE_STACKS; ++i) {
+    stack = &profile.stacks[i];
+    if (!stack->count) continue;
+    for (j = 0; j < stack->depth; ++j) {
+      if (j) luaL_addchar(&buffer, ';');
+      luaL_addstring(&buffer, profile.functions[stack->functions[j]].label);
+    }
+    lua_pushfstring(L, " %d\n", stack->count);
+    luaL_addvalue(&buffer);
+  }
+  luaL_pushresult(&buffer);
+}
+
+// writes the reports of -profile to "<filename>" and "<filename>.folded"
+static void px_profile_write(lua_State *L, const char *filename) {
+  FILE *file;
+  const char *data, *name;
+  size_t size;
+  int i;
+  px_profile_stop(L);
+  px_profile_report(L);
+  lua_pushstring(L, filename);
+  lua_pushfstring(L, "%s.folded", filename);
+  for (i = 0; i < 2; ++i) {
+    name = lua_tostring(L, -2 + i);
+    data = lua_tolstring(L, -4 + i, &size);
+    file = fopen(name, "wb");
+    if (!file) luaL_error(L, "cannot open %s for writing", name);
+    fwrite(data, 1, size, file);
+    fclose(file);
+  }
+  lua_pop(L, 4);
+}
+
+static int f_profile(lua_State *L) {
+  int interval = (int)luaL_optinteger(L, 2, PX_PROFILE_INTERVAL);
+  luaL_checktype(L, 1, LUA_TBOOLEAN);
+  luaL_argcheck(L, interval > 0, 2, "invalid interval");
+  if (lua_toboolean(L, 1)) { px_profile_start(L, interval); return 0; }
+  px_profile_stop(L);
+  px_profile_report(L);
+  return 2;
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Lua Api Mapping
@@ -838,23 +2727,50 @@ static const luaL_Reg px_functions[] = {
   {"print", f_print},
   // audio calls
   {"play", f_play},
+  {"sample", f_sample},
+  {"sfx", f_sfx},
+  {"song", f_song},
+  {"packsong", f_packsong},
+  {"playsong", f_playsong},
+  {"stopsong", f_stopsong},
   {"stop", f_stop},
   {"pause", f_pause},
+  {"volume", f_volume},
+  {"pan", f_pan},
+  {"render", f_render},
+  {"audioconfig", f_audioconfig},
+  {"audiostats", f_audiostats},
+  {"callbacks", f_callbacks},
+  {"spawn", f_spawn},
+  {"wait", f_wait},
+  {"sleep", f_sleep},
+  {"position", f_position},
   // input functions
   {"btn", f_btn},
   {"btnp", f_btnp},
+  {"buttons", f_buttons},
   {"mouse", f_mouse},
   // misc functions
   {"clipboard", f_clipboard},
   {"randomseed", f_randomseed},
+  {"gcstats", f_gcstats},
+  {"memstats", f_memstats},
+  {"stats", f_stats},
+  {"asset", f_asset},
+  {"profile", f_profile},
   {"random", f_random},
   {"quit", f_quit},
   {"title", f_title},
   {"time", f_time},
+  {"tickrate", f_tickrate},
   {"resolution", f_resolution},
   // compression stuff
   {"compress", f_compress},
   {"decompress", f_decompress},
+  // buffers
+  {"buffer", f_buffer},
+  // entities
+  {"entities", f_entities},
   // network
   {"bind", f_bind},
   {"unbind", f_unbind},
@@ -865,7 +2781,11 @@ static const luaL_Reg px_functions[] = {
 };
 
 static int px_lua_open(lua_State *L) {
+  int i;
   luaL_newlib(L, px_functions);
+  for (i = 0; i < PX_BUTTON_LAST; ++i) {
+    lua_pushinteger(L, 1 << i); lua_setfield(L, -2, button_names[i]);
+  }
   lua_pushstring(L, PX_AUTHOR); lua_setfield(L, -2, "_author");
   lua_pushinteger(L, PX_VERSION); lua_setfield(L, -2, "_version");
   return 1;
@@ -875,156 +2795,804 @@ static int px_lua_open(lua_State *L) {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Audio Mixing (MML parsing)
+//  Audio Mixing (MML compiling)
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-static void mml_reset_channel(AudioChannel *channel) {
-  if (channel->source) SDL_free((void*)channel->source);
-  SDL_zerop(channel);
-  channel->tempo = 140;
-  channel->octave = 3;
-  channel->waveform = PX_WAVEFORM_PULSE_50;
-  channel->default_length = 4;
+typedef struct MMLParser {
+  lua_State *L;
+  const char *source, *in;
+  AudioEvent *events;   // NULL while counting events
+  int count;
+  double position;      // exact song position in samples
+  int tempo, octave, default_length, waveform, volume, pan;
+} MMLParser;
+
+static void mml_error(MMLParser *p, const char *message) {
+  luaL_error(p->L, "MML error at position %d: %s", (int)(p->in - p->source), message);
 }
 
-static void mml_skip_spaces(AudioChannel *channel) {
-  while (SDL_isspace(*channel->in)) ++channel->in;
+static void mml_skip_spaces(MMLParser *p) {
+  while (SDL_isspace(*p->in) || *p->in == '|' || *p->in == ',') ++p->in;
 }
 
-static int mml_is_next(AudioChannel *channel, char ch) {
-  mml_skip_spaces(channel);
-  if (*channel->in == ch) { channel->in++; return 1; }
+static int mml_is_next(MMLParser *p, char ch) {
+  mml_skip_spaces(p);
+  if (*p->in == ch) { p->in++; return 1; }
   return 0;
 }
 
-static int mml_parse_number(AudioChannel *channel) {
+static int mml_parse_number(MMLParser *p) {
   int value = 0;
-  mml_skip_spaces(channel);
-  while (SDL_isdigit(*channel->in)) {
+  mml_skip_spaces(p);
+  while (SDL_isdigit(*p->in)) {
+    if (value > 9999) mml_error(p, "number too large");
     value *= 10;
-    value += *channel->in++ - '0';
+    value += *p->in++ - '0';
   }
   return value;
 }
 
-static void mml_parse_duration(AudioChannel *channel) {
-  float duration = (float)mml_parse_number(channel);
-  if (duration == 0.0f) duration = (float)channel->default_length;
-  duration = mixing_frequency / ((float)channel->tempo * 0.25f / 60.0f) * (1.0f / duration);
-  if (mml_is_next(channel, '.')) duration *= 1.5f;
-  channel->duration = (int)duration;
-  if (mml_is_next(channel, '&')) channel->silence = 0;
-  else channel->silence = (int)(duration * (1.0f / 8.0f));
+static int mml_parse_argument(MMLParser *p, int low, int high) {
+  int value;
+  mml_skip_spaces(p);
+  if (!SDL_isdigit(*p->in)) mml_error(p, "number expected");
+  value = mml_parse_number(p);
+  if (value < low || value > high) mml_error(p, "value out of range");
+  return value;
+}
+
+static void mml_emit(MMLParser *p, Uint32 step, int waveform) {
+  AudioEvent *event;
+  double length = (double)mml_parse_number(p);
+  int start, legato;
+  if (length == 0.0) length = (double)p->default_length;
+  length = mixing_frequency / ((double)p->tempo * 0.25 / 60.0) * (1.0 / length);
+  if (mml_is_next(p, '.')) length *= 1.5;
+  legato = mml_is_next(p, '&');
+  start = (int)p->position;
+  p->position += length;
+  if (p->events) {
+    event = &p->events[p->count];
+    event->step = step;
+    event->waveform = waveform;
+    event->duration = (int)p->position - start;
+    if (waveform == PX_WAVEFORM_SILENCE) event->gate = 0;
+    else if (legato) event->gate = event->duration;
+    else event->gate = event->duration - (int)(length * (1.0 / 8.0));
+    event->volume = p->volume * PX_AUDIO_VOLUME / 15;
+    event->pan = p->pan;
+    event->marker = -1;
+  }
+  p->pan = -1;
+  ++p->count;
 }
 
-static void mml_parse_note(AudioChannel *channel, int key) {
-  if (mml_is_next(channel, '#')) ++key;
-  else if (mml_is_next(channel, '+')) ++key;
-  else if (mml_is_next(channel, '-')) --key;
-  key += (channel->octave - 1) * 12;
-  channel->frequency = (float)SDL_pow(2.0, ((double)key - 49.0) / 12.0) * 440.0f;
-  channel->t = 0.0f;
-  mml_parse_duration(channel);
+// markers are events without duration
+static void mml_emit_marker(MMLParser *p, int id) {
+  AudioEvent *event;
+  if (p->events) {
+    event = &p->events[p->count];
+    SDL_zerop(event);
+    event->waveform = PX_WAVEFORM_SILENCE;
+    event->pan = -1;
+    event->marker = id;
+  }
+  ++p->count;
 }
 
-static void mml_parse_next(AudioChannel *channel) {
+static void mml_parse_note(MMLParser *p, int key) {
+  if (mml_is_next(p, '#')) ++key;
+  else if (mml_is_next(p, '+')) ++key;
+  else if (mml_is_next(p, '-')) --key;
+  key += (p->octave - 1) * 12;
+  mml_emit(p, audio_notes[key + PX_AUDIO_NOTE_OFFSET], p->waveform);
+}
+
+static void mml_parse(MMLParser *p) {
+  p->in = p->source;
+  p->count = 0;
+  p->position = 0.0;
+  p->tempo = 140;
+  p->octave = 3;
+  p->waveform = PX_WAVEFORM_PULSE_50;
+  p->default_length = 4;
+  p->volume = 15;
+  p->pan = -1;
   for (;;) {
-    if (!channel->in) return;
-    mml_skip_spaces(channel);
-    switch (*channel->in++) {
+    mml_skip_spaces(p);
+    switch (*p->in++) {
     case 0:
-      if (channel->looping) channel->in = channel->source;
-      else mml_reset_channel(channel);
-      break;
+      return;
     case 'T': case 't':
-      channel->tempo = mml_parse_number(channel);
+      p->tempo = mml_parse_argument(p, 1, 9999);
       break;
     case 'L': case 'l':
-      channel->default_length = mml_parse_number(channel);
+      p->default_length = mml_parse_argument(p, 1, 256);
       break;
     case 'O': case 'o':
-      channel->octave = mml_parse_number(channel);
+      p->octave = mml_parse_argument(p, 0, 9);
+      break;
+    case 'V': case 'v':
+      p->volume = mml_parse_argument(p, 0, 15);
+      break;
+    case 'Y': case 'y':
+      p->pan = mml_parse_argument(p, 0, 16);
+      break;
+    case 'M': case 'm':
+      mml_emit_marker(p, mml_parse_argument(p, 0, 9999));
       break;
     case '<':
-      --channel->octave;
+      if (--p->octave < 0) mml_error(p, "octave out of range");
       break;
     case '>':
-      ++channel->octave;
+      if (++p->octave > 9) mml_error(p, "octave out of range");
       break;
     case 'R': case 'r': case 'P': case 'p':
-      mml_parse_duration(channel);
-      channel->silence = channel->duration;
-      return;
-    case 'C': case 'c':
-      mml_parse_note(channel, 4);
-      return;
-    case 'D': case 'd':
-      mml_parse_note(channel, 6);
-      return;
-    case 'E': case 'e':
-      mml_parse_note(channel, 8);
-      return;
-    case 'F': case 'f':
-      mml_parse_note(channel, 9);
-      return;
-    case 'G': case 'g':
-      mml_parse_note(channel, 11);
-      return;
-    case 'A': case 'a':
-      mml_parse_note(channel, 13);
-      return;
-    case 'B': case 'b':
-      mml_parse_note(channel, 15);
-      return;
+      mml_emit(p, 0, PX_WAVEFORM_SILENCE);
+      break;
+    case 'C': case 'c': mml_parse_note(p, 4); break;
+    case 'D': case 'd': mml_parse_note(p, 6); break;
+    case 'E': case 'e': mml_parse_note(p, 8); break;
+    case 'F': case 'f': mml_parse_note(p, 9); break;
+    case 'G': case 'g': mml_parse_note(p, 11); break;
+    case 'A': case 'a': mml_parse_note(p, 13); break;
+    case 'B': case 'b': mml_parse_note(p, 15); break;
     case 'W': case 'w':
-      switch (*channel->in++) {
-      case '1': channel->waveform = PX_WAVEFORM_PULSE_12; break;
-      case '2': channel->waveform = PX_WAVEFORM_PULSE_25; break;
-      case '5': channel->waveform = PX_WAVEFORM_PULSE_50; break;
-      case 'T': case 't': channel->waveform = PX_WAVEFORM_TRIANLGE; break;
-      case 'S': case 's': channel->waveform = PX_WAVEFORM_SAWTOOTH; break;
-      case 'N': case 'n': channel->waveform = PX_WAVEFORM_NOISE; break;
+      switch (*p->in++) {
+      case '1': p->waveform = PX_WAVEFORM_PULSE_12; break;
+      case '2': p->waveform = PX_WAVEFORM_PULSE_25; break;
+      case '5': p->waveform = PX_WAVEFORM_PULSE_50; break;
+      case 'T': case 't': p->waveform = PX_WAVEFORM_TRIANLGE; break;
+      case 'S': case 's': p->waveform = PX_WAVEFORM_SAWTOOTH; break;
+      case 'N': case 'n': p->waveform = PX_WAVEFORM_NOISE; break;
+      default: --p->in; mml_error(p, "unknown waveform");
       }
       break;
+    default:
+      --p->in;
+      mml_error(p, "unexpected character");
     }
   }
 }
 
-static void px_audio_mixer_callback(void *userdata, Uint8 *stream, int len) {
-  Sint8 *out, value;
+// compiles the MML string at `idx` and pushes the program userdata
+static const AudioProgram *mml_compile(lua_State *L, int idx) {
+  AudioProgram *program;
+  MMLParser p;
+  SDL_zero(p);
+  p.L = L;
+  p.source = luaL_checkstring(L, idx);
+  // first pass validates and counts the events
+  mml_parse(&p);
+  program = (AudioProgram*)lua_newuserdata(L, sizeof(AudioProgram) + sizeof(AudioEvent) * p.count);
+  program->events = (AudioEvent*)(program + 1);
+  program->count = p.count;
+  // second pass fills the events
+  p.events = program->events;
+  mml_parse(&p);
+  program->length = (int)p.position;
+  return program;
+}
+
+// same as mml_compile() but reuses programs of already compiled strings
+static const AudioProgram *mml_compile_cached(lua_State *L, int idx) {
+  const AudioProgram *program;
+  idx = lua_absindex(L, idx);
+  lua_getfield(L, LUA_REGISTRYINDEX, PX_MML_CACHE);
+  lua_pushvalue(L, idx);
+  if (lua_rawget(L, -2) == LUA_TUSERDATA) {
+    program = (const AudioProgram*)lua_touserdata(L, -1);
+  }
+  else {
+    lua_pop(L, 1);
+    program = mml_compile(L, idx);
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_remove(L, -2);
+  return program;
+}
+
+static int mml_read16(const Uint8 *data) {
+  return data[0] | (data[1] << 8);
+}
+
+static void mml_write16(luaL_Buffer *buffer, int value) {
+  luaL_addchar(buffer, (char)(value & 0xFF));
+  luaL_addchar(buffer, (char)((value >> 8) & 0xFF));
+}
+
+// converts a song table into the binary song format and pushes it:
+// "PXS1", channels (u8), patterns (u16), orders (u16), the 0 based pattern
+// index of every order entry (u16) and then for every pattern and channel
+// the length (u16) and text of its MML string, all little endian
+static void mml_pack_song(lua_State *L, int idx) {
+  luaL_Buffer buffer;
+  const char *mml;
+  size_t length;
+  int i, j, pattern, patterns, orders, channels = 0, base = lua_gettop(L);
+  idx = lua_absindex(L, idx);
+  if (lua_getfield(L, idx, "patterns") != LUA_TTABLE) luaL_error(L, "song needs a patterns table");
+  if (lua_getfield(L, idx, "order") != LUA_TTABLE) luaL_error(L, "song needs an order table");
+  patterns = (int)luaL_len(L, -2);
+  orders = (int)luaL_len(L, -1);
+  if (patterns < 1 || patterns > 0xFFFF) luaL_error(L, "invalid number of patterns");
+  if (orders < 1 || orders > 0xFFFF) luaL_error(L, "invalid number of order entries");
+  for (i = 1; i <= patterns; ++i) {
+    if (lua_rawgeti(L, -2, i) != LUA_TTABLE) luaL_error(L, "pattern %d is not a table", i);
+    channels = SDL_max(channels, (int)luaL_len(L, -1));
+    lua_pop(L, 1);
+  }
+  if (channels < 1 || channels > PX_AUDIO_CHANNELS) luaL_error(L, "patterns must use 1 - %d channels", PX_AUDIO_CHANNELS);
+
+  // the stack must stay balanced between buffer operations, strings are anchored in the song table
+  luaL_buffinit(L, &buffer);
+  luaL_addlstring(&buffer, "PXS1", 4);
+  luaL_addchar(&buffer, (char)channels);
+  mml_write16(&buffer, patterns);
+  mml_write16(&buffer, orders);
+  for (i = 1; i <= orders; ++i) {
+    lua_rawgeti(L, base + 2, i);
+    pattern = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (pattern < 1 || pattern > patterns) luaL_error(L, "order entry %d references an unknown pattern", i);
+    mml_write16(&buffer, pattern - 1);
+  }
+  for (i = 1; i <= patterns; ++i) {
+    for (j = 1; j <= channels; ++j) {
+      lua_rawgeti(L, base + 1, i);
+      lua_rawgeti(L, -1, j);
+      mml = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &length) : NULL;
+      if (!mml && !lua_isnil(L, -1) && lua_toboolean(L, -1)) luaL_error(L, "channel %d of pattern %d is not a string", j, i);
+      if (!mml) length = 0;
+      lua_pop(L, 2);
+      if (length > 0xFFFF) luaL_error(L, "channel %d of pattern %d is too long", j, i);
+      mml_write16(&buffer, (int)length);
+      luaL_addlstring(&buffer, mml, length);
+    }
+  }
+  luaL_pushresult(&buffer);
+  lua_replace(L, base + 1);
+  lua_settop(L, base + 1);
+}
+
+// compiles a song table or (LZ4 compressed) song string and pushes the song userdata
+static const AudioSong *mml_compile_song(lua_State *L, int idx) {
+  AudioSong *song;
+  const Uint8 *data, *end;
+  size_t size;
+  int i, j, length, base = lua_gettop(L), channels, patterns, orders;
+  idx = lua_absindex(L, idx);
+  if (lua_istable(L, idx)) {
+    mml_pack_song(L, idx);
+    idx = lua_gettop(L);
+  }
+  data = (const Uint8*)luaL_checklstring(L, idx, &size);
+  if (size >= 8 && !SDL_memcmp(data, "PXSZ", 4)) {
+    length = mml_read16(data + 4) | (mml_read16(data + 6) << 16);
+    if (length <= 0 || length > PX_SONG_MAX_SIZE) luaL_error(L, "invalid song size");
+    end = (const Uint8*)lua_newuserdata(L, length);
+    if (LZ4_decompress_safe((const char*)data + 8, (char*)end, (int)size - 8, length) != length) luaL_error(L, "corrupt song data");
+    data = end;
+    size = length;
+  }
+  if (size < 9 || SDL_memcmp(data, "PXS1", 4)) luaL_error(L, "invalid song data");
+  end = data + size;
+  channels = data[4];
+  patterns = mml_read16(data + 5);
+  orders = mml_read16(data + 7);
+  data += 9;
+  if (channels < 1 || channels > PX_AUDIO_CHANNELS || patterns < 1 || orders < 1) luaL_error(L, "invalid song header");
+  if (end - data < 2 * orders) luaL_error(L, "truncated song data");
+
+  // everything lives in one userdata, the compiled patterns are kept in its user value
+  song = (AudioSong*)lua_newuserdata(L, sizeof(AudioSong) + sizeof(int) * (orders + patterns) + sizeof(AudioProgram*) * patterns * channels);
+  song->programs = (const AudioProgram**)(song + 1);
+  song->order = (int*)(song->programs + patterns * channels);
+  song->lengths = song->order + orders;
+  song->channels = channels;
+  song->patterns = patterns;
+  song->orders = orders;
+  for (i = 0; i < orders; ++i, data += 2) {
+    song->order[i] = mml_read16(data);
+    if (song->order[i] >= patterns) luaL_error(L, "order entry %d references an unknown pattern", i + 1);
+  }
+  lua_createtable(L, patterns * channels, 0);
+  for (i = 0; i < patterns; ++i) {
+    song->lengths[i] = 0;
+    for (j = 0; j < channels; ++j) {
+      if (end - data < 2) luaL_error(L, "truncated song data");
+      length = mml_read16(data);
+      data += 2;
+      if (end - data < length) luaL_error(L, "truncated song data");
+      song->programs[i * channels + j] = NULL;
+      if (!length) continue;
+      lua_pushlstring(L, (const char*)data, length);
+      song->programs[i * channels + j] = mml_compile(L, -1);
+      song->lengths[i] = SDL_max(song->lengths[i], song->programs[i * channels + j]->length);
+      lua_rawseti(L, -3, i * channels + j + 1);
+      lua_pop(L, 1);
+      data += length;
+    }
+    if (!song->lengths[i]) luaL_error(L, "pattern %d is empty", i + 1);
+  }
+  lua_setuservalue(L, -2);
+  luaL_setmetatable(L, PX_SONG_TYPE);
+  // drop the temporary strings, the song may already be the only new value
+  if (lua_gettop(L) > base + 1) {
+    lua_replace(L, base + 1);
+    lua_settop(L, base + 1);
+  }
+  return song;
+}
+
+// hands a registry reference back to the game thread
+static void px_audio_release_ref(int ref) {
+  int head = SDL_AtomicGet(&audio_release_head);
+  int next = (head + 1) % PX_AUDIO_RELEASES;
+  // the ring is large enough for every living reference, leak instead of blocking
+  if (next != SDL_AtomicGet(&audio_release_tail)) {
+    SDL_MemoryBarrierAcquire();
+    audio_releases[head] = ref;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&audio_release_head, next);
+  }
+}
+
+static void px_audio_release(AudioChannel *channel) {
+  channel->program = NULL;
+  channel->sample.data = NULL;
+  if (channel->ref < 0) return;
+  px_audio_release_ref(channel->ref);
+  channel->ref = LUA_NOREF;
+  SDL_AtomicSet(&voice_ended[channel->voice], channel->generation);
+}
+
+// stops the song and the channels still playing its patterns
+static void px_audio_stop_song(AudioSongPlayer *player, AudioChannel *mix_channels) {
+  int i;
+  if (!player->song) return;
+  for (i = 0; i < player->song->channels; ++i) {
+    if (mix_channels[i].program && mix_channels[i].ref < 0) px_audio_release(&mix_channels[i]);
+  }
+  px_audio_release_ref(player->ref);
+  player->song = NULL;
+  player->ref = LUA_NOREF;
+}
+
+// starts the next pattern on all channels of the song at the same sample
+static void px_audio_next_pattern(AudioSongPlayer *player, AudioChannel *mix_channels) {
+  const AudioSong *song = player->song;
   AudioChannel *channel;
-  float v;
-  int i, j, waveform;
+  int i, pattern;
+  if (player->order >= song->orders) {
+    if (!player->looping) { px_audio_stop_song(player, mix_channels); return; }
+    player->order = 0;
+  }
+  pattern = song->order[player->order++];
+  for (i = 0; i < song->channels; ++i) {
+    channel = &mix_channels[i];
+    px_audio_release(channel);
+    channel->program = song->programs[pattern * song->channels + i];
+    channel->clock = player->position;
+    channel->event = 0;
+    channel->looping = 0;
+    channel->waveform = PX_WAVEFORM_SILENCE;
+    channel->duration = channel->silence = 0;
+  }
+  player->remaining = song->lengths[pattern];
+}
 
-  (void)userdata;
-  for (i = 0, out = (Sint8*)stream; i < len; ++i) {
-    value = 0;
-    for (j = 0; j < PX_AUDIO_CHANNELS; ++j) {
-      channel = &channels[j];
-      if (--channel->duration < 0) mml_parse_next(channel);
-      if (channel->duration > channel->silence) waveform = channel->waveform;
-      else waveform = PX_WAVEFORM_SILENCE;
-      channel->t += 1.0f / mixing_frequency * channel->frequency;
-      channel->t -= (int)channel->t;
-      switch (waveform) {
-      case PX_WAVEFORM_PULSE_12: value += channel->t <= 0.125f ? 4 : -4; break;
-      case PX_WAVEFORM_PULSE_25: value += channel->t <= 0.25f ? 4 : -4; break;
-      case PX_WAVEFORM_PULSE_50: value += channel->t <= 0.5f ? 4 : -4; break;
-      case PX_WAVEFORM_SAWTOOTH: value += (Sint8)((-1.0f + channel->t * 2.0f) * 4.0f); break;
-      case PX_WAVEFORM_TRIANLGE:
-        if (channel->t < 0.25f) v = channel->t * 4.0f;
-        else if (channel->t < 0.75f) v = 1.0f - ((channel->t - 0.25f) * 4.0f);
-        else v = -1.0f + ((channel->t) - 0.75f) * 4.0f;
-        value += (Sint8)(v * 8.0f);
-        break;
-      case PX_WAVEFORM_NOISE: value += audio_noise[(int)(channel->t * (float)PX_AUDIO_NOISE)]; break;
+static void px_audio_reset_stats() {
+  int i;
+  for (i = 0; i < PX_AUDIO_HISTOGRAM; ++i) SDL_AtomicSet(&audio_histogram[i], 0);
+  SDL_AtomicSet(&audio_callbacks, 0);
+  SDL_AtomicSet(&audio_late, 0);
+  SDL_AtomicSet(&audio_mix_min, 0);
+  SDL_AtomicSet(&audio_mix_total, 0);
+}
+
+// executes all commands queued by the game thread
+static void px_audio_run_commands() {
+  AudioCommand *command;
+  AudioChannel *channel;
+  int i, tail = SDL_AtomicGet(&audio_command_tail);
+  int head = SDL_AtomicGet(&audio_command_head);
+  SDL_MemoryBarrierAcquire(); // the commands up to head are written
+  for (; tail != head; tail = (tail + 1) % PX_AUDIO_COMMANDS) {
+    command = &audio_commands[tail];
+    channel = &channels[command->channel];
+    switch (command->type) {
+    case PX_AUDIO_PLAY:
+      px_audio_release(channel);
+      channel->program = command->program;
+      channel->ref = command->ref;
+      channel->generation = command->generation;
+      channel->clock = channel->events = 0;
+      channel->event = 0;
+      channel->looping = command->value;
+      channel->waveform = PX_WAVEFORM_SILENCE;
+      channel->duration = channel->silence = 0;
+      break;
+    case PX_AUDIO_PLAY_SAMPLE:
+      px_audio_release(channel);
+      channel->sample = command->sample;
+      channel->ref = command->ref;
+      channel->looping = command->value;
+      channel->clock = channel->events = 0;
+      channel->position = channel->fraction = 0;
+      break;
+    case PX_AUDIO_STOP:
+      px_audio_release(channel);
+      break;
+    case PX_AUDIO_PAUSE:
+      audio_paused = command->value;
+      break;
+    case PX_AUDIO_SET_VOLUME:
+      channel->volume = command->value;
+      break;
+    case PX_AUDIO_SET_PAN:
+      channel->pan = command->value;
+      break;
+    case PX_AUDIO_RESET_STATS:
+      px_audio_reset_stats();
+      break;
+    case PX_AUDIO_PLAY_SONG:
+      px_audio_stop_song(&audio_song, channels);
+      audio_song.song = command->song;
+      audio_song.ref = command->ref;
+      audio_song.looping = command->value;
+      audio_song.order = audio_song.remaining = 0;
+      audio_song.position = 0;
+      for (i = 0; i < audio_song.song->channels; ++i) channels[i].events = 0;
+      break;
+    case PX_AUDIO_STOP_SONG:
+      px_audio_stop_song(&audio_song, channels);
+      break;
+    }
+  }
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&audio_command_tail, tail);
+}
+
+// reports a marker to the game thread, markers are dropped while the ring is full
+static void px_audio_push_marker(AudioChannel *channel, int id) {
+  int head = SDL_AtomicGet(&audio_marker_head);
+  int next = (head + 1) % PX_AUDIO_MARKERS;
+  if (channel->voice < 0 || next == SDL_AtomicGet(&audio_marker_tail)) return;
+  SDL_MemoryBarrierAcquire();
+  audio_markers[head].channel = channel->voice < PX_AUDIO_CHANNELS ? channel->voice : (channel->generation << 8) | channel->voice;
+  audio_markers[head].id = id;
+  audio_markers[head].position = (int)channel->clock;
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&audio_marker_head, next);
+}
+
+// loads the next event of the program into the channel
+static void px_audio_next_event(AudioChannel *channel) {
+  const AudioEvent *event;
+  if (channel->event >= channel->program->count) {
+    if (!channel->looping) { px_audio_release(channel); return; }
+    channel->event = 0;
+  }
+  event = &channel->program->events[channel->event++];
+  if (event->marker >= 0) px_audio_push_marker(channel, event->marker);
+  else ++channel->events;
+  if (event->waveform != PX_WAVEFORM_SILENCE) {
+    channel->phase = 0;
+    channel->step = event->step;
+    channel->waveform = event->waveform;
+    channel->amplitude = event->volume;
+  }
+  if (event->pan >= 0) channel->pan = (event->pan - 8) * (PX_AUDIO_VOLUME / 8);
+  channel->duration = event->duration;
+  channel->silence = event->duration - event->gate;
+}
+
+// renders `count` samples of the given waveform into `out`
+static void px_audio_render_span(AudioChannel *channel, int waveform, Sint16 *out, int count) {
+  Uint32 phase = channel->phase, step = channel->step, duty, fold;
+  int i, scale = channel->amplitude, high = 4 * scale;
+
+  switch (waveform) {
+  case PX_WAVEFORM_PULSE_12: case PX_WAVEFORM_PULSE_25: case PX_WAVEFORM_PULSE_50:
+    if (waveform == PX_WAVEFORM_PULSE_12) duty = 0x20000000;
+    else if (waveform == PX_WAVEFORM_PULSE_25) duty = 0x40000000;
+    else duty = 0x80000000;
+    for (i = 0; i < count; ++i) {
+      phase += step;
+      out[i] = (Sint16)(phase <= duty ? high : -high);
+    }
+    break;
+  case PX_WAVEFORM_SAWTOOTH:
+    for (i = 0; i < count; ++i) {
+      phase += step;
+      out[i] = (Sint16)(((Sint32)(phase >> 29) - 4) * scale);
+    }
+    break;
+  case PX_WAVEFORM_TRIANLGE:
+    for (i = 0; i < count; ++i) {
+      phase += step;
+      // shift by a quarter cycle and fold the upper half down
+      fold = phase + 0x40000000;
+      if (fold & 0x80000000) fold = ~fold;
+      out[i] = (Sint16)(((Sint32)(fold >> 27) - 8) * scale);
+    }
+    break;
+  case PX_WAVEFORM_NOISE:
+    for (i = 0; i < count; ++i) {
+      phase += step;
+      out[i] = (Sint16)(audio_noise[phase >> (32 - PX_AUDIO_NOISE_BITS)] * scale);
+    }
+    break;
+  default: // silence only advances the phase
+    phase += step * (Uint32)count;
+    break;
+  }
+  channel->phase = phase;
+}
+
+// adds a mono span with the given gains (0 - 256) to the stereo accumulator
+static void px_audio_accumulate(Sint32 *acc, const Sint16 *voice, int count, int left, int right) {
+  int i = 0;
+#if defined(PX_AUDIO_SSE2)
+  __m128i gains = _mm_set_epi16((short)right, (short)left, (short)right, (short)left, (short)right, (short)left, (short)right, (short)left);
+  __m128i v, lo, hi, lo_l, lo_h, hi_l, hi_h, *a;
+  for (; i + 8 <= count; i += 8) {
+    v = _mm_loadu_si128((const __m128i*)(voice + i));
+    // duplicate every sample for both sides and do 16x16 -> 32 bit multiplies
+    lo = _mm_unpacklo_epi16(v, v); hi = _mm_unpackhi_epi16(v, v);
+    lo_l = _mm_mullo_epi16(lo, gains); lo_h = _mm_mulhi_epi16(lo, gains);
+    hi_l = _mm_mullo_epi16(hi, gains); hi_h = _mm_mulhi_epi16(hi, gains);
+    a = (__m128i*)(acc + 2 * i);
+    _mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(lo_l, lo_h)));
+    _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo_l, lo_h)));
+    _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi_l, hi_h)));
+    _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi_l, hi_h)));
+  }
+#elif defined(PX_AUDIO_NEON)
+  const int16_t g[4] = { (int16_t)left, (int16_t)right, (int16_t)left, (int16_t)right };
+  int16x4_t gains = vld1_s16(g);
+  int16x8x2_t v;
+  int32_t *a;
+  for (; i + 8 <= count; i += 8) {
+    v = vzipq_s16(vld1q_s16(voice + i), vld1q_s16(voice + i));
+    a = acc + 2 * i;
+    vst1q_s32(a + 0, vmlal_s16(vld1q_s32(a + 0), vget_low_s16(v.val[0]), gains));
+    vst1q_s32(a + 4, vmlal_s16(vld1q_s32(a + 4), vget_high_s16(v.val[0]), gains));
+    vst1q_s32(a + 8, vmlal_s16(vld1q_s32(a + 8), vget_low_s16(v.val[1]), gains));
+    vst1q_s32(a + 12, vmlal_s16(vld1q_s32(a + 12), vget_high_s16(v.val[1]), gains));
+  }
+#endif
+  for (; i < count; ++i) {
+    acc[2 * i + 0] += voice[i] * left;
+    acc[2 * i + 1] += voice[i] * right;
+  }
+}
+
+// scales the accumulator down and saturates it to 16 bit samples
+static void px_audio_clamp(Sint16 *out, const Sint32 *acc, int count) {
+  int i = 0, v;
+#if defined(PX_AUDIO_SSE2)
+  __m128i a, b;
+  for (; i + 8 <= count; i += 8) {
+    a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(acc + i)), 8);
+    b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(acc + i + 4)), 8);
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(a, b));
+  }
+#elif defined(PX_AUDIO_NEON)
+  for (; i + 8 <= count; i += 8) {
+    vst1q_s16(out + i, vcombine_s16(vqmovn_s32(vshrq_n_s32(vld1q_s32(acc + i), 8)), vqmovn_s32(vshrq_n_s32(vld1q_s32(acc + i + 4), 8))));
+  }
+#endif
+  for (; i < count; ++i) {
+    v = acc[i] >> 8;
+    out[i] = (Sint16)(v < -32768 ? -32768 : v > 32767 ? 32767 : v);
+  }
+}
+
+static void px_audio_gains(const AudioChannel *channel, int *left, int *right) {
+  *left = channel->volume * (channel->pan > 0 ? PX_AUDIO_VOLUME - channel->pan : PX_AUDIO_VOLUME) / PX_AUDIO_VOLUME;
+  *right = channel->volume * (channel->pan < 0 ? PX_AUDIO_VOLUME + channel->pan : PX_AUDIO_VOLUME) / PX_AUDIO_VOLUME;
+}
+
+static int px_audio_sample_at(const AudioSample *sample, Uint32 position) {
+  if (sample->bits == 8) return ((const Sint8*)sample->data)[position] * 256;
+  return ((const Sint16*)sample->data)[position];
+}
+
+// resamples the PCM data with linear interpolation into the stereo accumulator
+static void px_audio_mix_sample(AudioChannel *channel, Sint32 *acc, int len) {
+  Sint16 voice[PX_AUDIO_BLOCK];
+  const AudioSample *sample = &channel->sample;
+  Uint32 position = channel->position, fraction = channel->fraction, length = (Uint32)sample->length;
+  int i, s0, s1, left, right;
+  for (i = 0; i < len; ++i) {
+    if (position >= length) {
+      if (!channel->looping) break;
+      position %= length;
+    }
+    s0 = px_audio_sample_at(sample, position);
+    if (position + 1 < length) s1 = px_audio_sample_at(sample, position + 1);
+    else s1 = channel->looping ? px_audio_sample_at(sample, 0) : s0;
+    voice[i] = (Sint16)((s0 + (((s1 - s0) * (Sint32)(fraction >> 1)) >> 15)) >> 3);
+    fraction += sample->step;
+    position += fraction >> 16;
+    fraction &= 0xFFFF;
+  }
+  px_audio_gains(channel, &left, &right);
+  px_audio_accumulate(acc, voice, i, left, right);
+  channel->position = position;
+  channel->fraction = fraction;
+  if (i < len) px_audio_release(channel);
+}
+
+// renders a channel into the stereo accumulator, one span per MML event
+static void px_audio_mix_channel(AudioChannel *channel, Sint32 *acc, int len) {
+  Sint16 voice[PX_AUDIO_BLOCK];
+  int count, left, right;
+  if (channel->sample.data) { px_audio_mix_sample(channel, acc, len); channel->clock += len; return; }
+  while (len > 0) {
+    if (channel->duration <= 0) {
+      px_audio_next_event(channel);
+      if (!channel->program) return; // channel is idle
+      continue;
+    }
+    if (channel->duration > channel->silence) {
+      count = SDL_min(len, channel->duration - channel->silence);
+      px_audio_render_span(channel, channel->waveform, voice, count);
+      px_audio_gains(channel, &left, &right);
+      px_audio_accumulate(acc, voice, count, left, right);
+    }
+    else {
+      count = SDL_min(len, channel->duration);
+      px_audio_render_span(channel, PX_WAVEFORM_SILENCE, voice, count);
+    }
+    channel->duration -= count;
+    channel->clock += count;
+    acc += 2 * count; len -= count;
+  }
+}
+
+// collects the channels with something to play
+static int px_audio_active(AudioChannel *mix_channels, int count, AudioChannel **active) {
+  int i, num_active = 0;
+  for (i = 0; i < count; ++i) {
+    if (mix_channels[i].program || mix_channels[i].sample.data) active[num_active++] = &mix_channels[i];
+  }
+  return num_active;
+}
+
+// mixes up to PX_AUDIO_VOICES channels and an optional song into a signed 16 bit stereo `stream`,
+// also used for offline rendering
+static void px_audio_mix(AudioChannel *mix_channels, int count, AudioSongPlayer *player, Uint8 *stream, int len) {
+  Sint32 acc[PX_AUDIO_BLOCK * 2];
+  AudioChannel *active[PX_AUDIO_VOICES];
+  Sint16 *out = (Sint16*)stream;
+  int i, block, frames = len / (2 * (int)sizeof(Sint16));
+  // idle voices are skipped once, not per block
+  int num_active = px_audio_active(mix_channels, count, active);
+  for (; frames > 0; frames -= block, out += 2 * block) {
+    block = SDL_min(frames, PX_AUDIO_BLOCK);
+    // blocks end at pattern boundaries so all channels switch on the same sample
+    if (player && player->song) {
+      if (player->remaining <= 0) {
+        px_audio_next_pattern(player, mix_channels);
+        num_active = px_audio_active(mix_channels, count, active);
+      }
+      if (player->song) {
+        block = SDL_min(block, player->remaining);
+        player->remaining -= block;
+        player->position += block;
       }
     }
-    *out++ = value;
+    SDL_memset(acc, 0, sizeof(Sint32) * 2 * block);
+    for (i = 0; i < num_active; ++i) {
+      if (active[i]->program || active[i]->sample.data) px_audio_mix_channel(active[i], acc, block);
+    }
+    px_audio_clamp(out, acc, 2 * block);
   }
 }
 
+static void px_audio_mixer_callback(void *userdata, Uint8 *stream, int len) {
+  Uint64 start = SDL_GetPerformanceCounter(), frequency = SDL_GetPerformanceFrequency();
+  int i, active, elapsed, late;
+
+  (void)userdata;
+  px_audio_run_commands();
+  // publish the clock of every voice before mixing the next buffer
+  SDL_AtomicAdd(&audio_clock_sequence, 1);
+  SDL_AtomicSet(&audio_clock_time, (int)(Uint32)start);
+  SDL_AtomicSet(&audio_clock_running, !audio_paused && !audio_writer.lockstep); // lockstep positions must not depend on the wall clock
+  for (i = 0; i < audio_voices; ++i) {
+    active = channels[i].program || channels[i].sample.data;
+    SDL_AtomicSet(&audio_positions[i], active ? (int)channels[i].clock : -1);
+    SDL_AtomicSet(&audio_events[i], channels[i].events);
+  }
+  SDL_AtomicAdd(&audio_clock_sequence, 1);
+  if (audio_paused) SDL_memset(stream, 0, len);
+  else px_audio_mix(channels, audio_voices, &audio_song, stream, len);
+
+  // measure the mixing time and check if we came close to the deadline
+  elapsed = (int)((SDL_GetPerformanceCounter() - start) * 1000000 / frequency);
+  late = audio_last_callback && (int)((start - audio_last_callback) * 1000000 / frequency) > audio_deadline + audio_deadline / 2;
+  audio_last_callback = start;
+  SDL_AtomicSet(&audio_mix_time, elapsed);
+  if (elapsed > SDL_AtomicGet(&audio_mix_max)) SDL_AtomicSet(&audio_mix_max, elapsed);
+  if (!SDL_AtomicGet(&audio_callbacks) || elapsed < SDL_AtomicGet(&audio_mix_min)) SDL_AtomicSet(&audio_mix_min, elapsed);
+  SDL_AtomicAdd(&audio_mix_total, elapsed);
+  SDL_AtomicAdd(&audio_histogram[px_audio_bucket(elapsed)], 1);
+  // a callback is late if it was delayed or mixing took longer than the buffer lasts
+  if (late || elapsed > audio_deadline) SDL_AtomicAdd(&audio_late, 1);
+  SDL_AtomicAdd(&audio_callbacks, 1);
+  if (audio_adaptive && audio_samples < PX_AUDIO_MAX_SAMPLES && (late || elapsed * 2 > audio_deadline)) SDL_AtomicSet(&audio_grow, 1);
+}
+
+// streams the ring buffer to disk so the mixer never waits for the file system
+static int px_audio_writer_thread(void *userdata) {
+  int tail, count;
+  (void)userdata;
+  SDL_LockMutex(audio_writer.mutex);
+  for (;;) {
+    while (audio_writer.head == audio_writer.tail && !audio_writer.done) SDL_CondWait(audio_writer.cond, audio_writer.mutex);
+    if (audio_writer.head == audio_writer.tail) break;
+    tail = audio_writer.tail;
+    count = (audio_writer.head > tail ? audio_writer.head : PX_AUDIO_WRITER) - tail;
+    SDL_UnlockMutex(audio_writer.mutex);
+    fwrite(audio_writer.buffer + tail, 1, count, audio_writer.file);
+    SDL_LockMutex(audio_writer.mutex);
+    audio_writer.tail = (tail + count) % PX_AUDIO_WRITER;
+    SDL_CondSignal(audio_writer.cond);
+  }
+  SDL_UnlockMutex(audio_writer.mutex);
+  return 0;
+}
+
+// mixes one buffer and queues it for the writer thread, waits while the ring is full
+static void px_audio_write(int frames) {
+  Uint8 stream[PX_AUDIO_MAX_SAMPLES * 2 * sizeof(Sint16)];
+  int count, len = frames * 2 * (int)sizeof(Sint16), offset = 0;
+  px_audio_mixer_callback(NULL, stream, len);
+  audio_writer.bytes += len;
+  SDL_LockMutex(audio_writer.mutex);
+  while (offset < len) {
+    while ((audio_writer.head + 1) % PX_AUDIO_WRITER == audio_writer.tail) SDL_CondWait(audio_writer.cond, audio_writer.mutex);
+    if (audio_writer.head >= audio_writer.tail) count = PX_AUDIO_WRITER - audio_writer.head - (audio_writer.tail == 0);
+    else count = audio_writer.tail - audio_writer.head - 1;
+    count = SDL_min(count, len - offset);
+    SDL_memcpy(audio_writer.buffer + audio_writer.head, stream + offset, count);
+    audio_writer.head = (audio_writer.head + count) % PX_AUDIO_WRITER;
+    offset += count;
+    SDL_CondSignal(audio_writer.cond);
+  }
+  SDL_UnlockMutex(audio_writer.mutex);
+}
+
+// mixes the samples of one tick in lockstep, fractions of a sample are carried to the next tick
+static void px_audio_write_tick() {
+  int count;
+  audio_writer.fraction += PX_AUDIO_FREQUENCY;
+  count = audio_writer.fraction / tick_rate;
+  audio_writer.fraction -= count * tick_rate;
+  for (; count > 0; count -= PX_AUDIO_MAX_SAMPLES) px_audio_write(SDL_min(count, PX_AUDIO_MAX_SAMPLES));
+}
+
+// replaces the sound card callback when writing to disk in real time
+static int px_audio_timer_thread(void *userdata) {
+  Uint64 frequency = SDL_GetPerformanceFrequency();
+  Uint64 next = SDL_GetPerformanceCounter(), now;
+  (void)userdata;
+  while (!SDL_AtomicGet(&audio_writer.quit)) {
+    px_audio_write(audio_samples);
+    next += (Uint64)audio_samples * frequency / (Uint64)mixing_frequency;
+    now = SDL_GetPerformanceCounter();
+    if (next > now) SDL_Delay((Uint32)((next - now) * 1000 / frequency));
+  }
+  return 0;
+}
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1097,6 +3665,9 @@ static void px_handle_keys(const SDL_Event *ev) {
     case SDLK_ESCAPE:
       running = SDL_FALSE;
       return;
+    case SDLK_F11:
+      show_stats = !show_stats;
+      return;
     case SDLK_F12:
       fullscreen = !fullscreen;
       SDL_SetWindowFullscreen(window, fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
@@ -1147,6 +3718,57 @@ static void px_handle_controller(const SDL_Event *ev) {
   px_set_button(ev->cbutton.which, button, ev->type == SDL_CONTROLLERBUTTONDOWN);
 }
 
+static void px_frame_begin() {
+  frame_stats.start = frame_stats.mark = SDL_GetPerformanceCounter();
+  SDL_zero(frame_stats.times[frame_stats.current]);
+  px_pool_next_frame(&mem_pool);
+}
+
+// adds the time since the last mark to a stage of the current frame
+static void px_frame_mark(int stage) {
+  Uint64 now = SDL_GetPerformanceCounter();
+  frame_stats.times[frame_stats.current][stage] += now - frame_stats.mark;
+  frame_stats.mark = now;
+}
+
+static void px_frame_end() {
+  frame_stats.times[frame_stats.current][PX_STAGE_TOTAL] = SDL_GetPerformanceCounter() - frame_stats.start;
+  frame_stats.current = (frame_stats.current + 1) % PX_FRAME_HISTORY;
+  if (frame_stats.count < PX_FRAME_HISTORY) ++frame_stats.count;
+}
+
+// draws the last and 95th percentile times in ms into the top left corner,
+// the pixels below are saved for px_restore_stats()
+static void px_draw_stats() {
+  double scale = 1000.0 / (double)SDL_GetPerformanceFrequency();
+  const Uint64 *last = px_frame_last();
+  Uint64 percentiles[4];
+  char lines[PX_STATS_ROWS][PX_STATS_COLUMNS + 1];
+  const char *str;
+  int i, x, y;
+  Uint8 glyph;
+  SDL_snprintf(lines[0], sizeof(lines[0]), "ms       last   p95");
+  for (i = 0; i < PX_STAGE_LAST; ++i) {
+    px_frame_percentiles(i, percentiles);
+    SDL_snprintf(lines[i + 1], sizeof(lines[i + 1]), "%-7s %5.1f %5.1f", stage_names[i], (double)last[i] * scale, (double)percentiles[1] * scale);
+  }
+  for (x = 0; x < PX_STATS_COLUMNS * 8 && x < screen_width; ++x) {
+    for (y = 0; y < PX_STATS_ROWS * 8 && y < screen_height; ++y) {
+      stats_backup[x][y] = screen[x][y];
+      str = lines[y / 8];
+      glyph = SDL_strlen(str) > (size_t)(x / 8) ? font8x8[str[x / 8] & 127][y & 7] : 0;
+      screen[x][y] = (glyph & (1 << (x & 7))) ? 7 : 0;
+    }
+  }
+}
+
+static void px_restore_stats() {
+  int x, y;
+  for (x = 0; x < PX_STATS_COLUMNS * 8 && x < screen_width; ++x) {
+    for (y = 0; y < PX_STATS_ROWS * 8 && y < screen_height; ++y) screen[x][y] = stats_backup[x][y];
+  }
+}
+
 static void px_render_screen(lua_State *L) {
   const SDL_Color *color;
   Uint8 *pixels, *p;
@@ -1169,26 +3791,67 @@ static void px_render_screen(lua_State *L) {
     }
   }
   SDL_UnlockTexture(texture);
+  px_frame_mark(PX_STAGE_UPLOAD);
 
   // render everything
   if (SDL_SetRenderDrawColor(renderer, 16, 16, 16, 255)) luaL_error(L, "SDL_SetRenderDrawColor() failed: %s", SDL_GetError());
   if (SDL_RenderClear(renderer)) luaL_error(L, "SDL_RenderClear() failed: %s", SDL_GetError());
   if (SDL_RenderCopy(renderer, texture, NULL, NULL)) luaL_error(L, "SDL_RenderCopy() failed: %s", SDL_GetError());
   SDL_RenderPresent(renderer);
+  px_frame_mark(PX_STAGE_PRESENT);
+}
+
+static void px_audio_open(lua_State *L, int samples);
+static void px_audio_write_tick();
+
+// the automatic collector is stopped during the main loop, instead the main loop steps it for `budget`
+// milliseconds; only when memory passes the limit within a frame the allocator lets Lua collect by itself
+static void px_collect_garbage(lua_State *L, int budget) {
+  Uint64 start = SDL_GetPerformanceCounter();
+  Uint64 deadline = start + (Uint64)SDL_max(budget, 0) * SDL_GetPerformanceFrequency() / 1000;
+  size_t memory = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024;
+  gc_stats.time = 0;
+  if (lua_gc(L, LUA_GCISRUNNING, 0)) {
+    // the valve opened, the cycle Lua started is finished here
+    lua_gc(L, LUA_GCSTOP, 0);
+    gc_stats.active = SDL_TRUE;
+  }
+  mem_pool.limit = gc_stats.threshold * PX_GC_LIMIT;
+  if (!gc_stats.active && memory < gc_stats.threshold) return;
+  gc_stats.active = SDL_TRUE;
+  // at least one step per frame, without a budget the cycle is finished when memory got out of hand
+  do {
+    if (lua_gc(L, LUA_GCSTEP, 0)) {
+      gc_stats.active = SDL_FALSE;
+      gc_stats.threshold = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 * PX_GC_GROWTH;
+      mem_pool.limit = gc_stats.threshold * PX_GC_LIMIT;
+      ++gc_stats.cycles;
+      break;
+    }
+  } while (SDL_GetPerformanceCounter() < deadline || memory > gc_stats.threshold * PX_GC_LIMIT);
+  gc_stats.time = SDL_GetPerformanceCounter() - start;
+  gc_stats.total_time += gc_stats.time;
+  if (gc_stats.time > gc_stats.max_time) gc_stats.max_time = gc_stats.time;
 }
 
 static void px_run_main_loop(lua_State *L) {
-  int i;
+  int i, updates;
   SDL_Event ev;
-  Uint32 last_tick, current_tick, delta_ticks;
+  Uint64 frequency = SDL_GetPerformanceFrequency(), last, current;
+  Sint64 left;
+  double step;
 
   // init callback
-  if (lua_getglobal(L, "init") == LUA_TFUNCTION) lua_call(L, 0, 0);
-  else lua_pop(L, 1);
+  px_call_callback(L, PX_CALLBACK_INIT, 0);
+  // from now on the garbage is collected between the frames, see px_collect_garbage()
+  lua_gc(L, LUA_GCSTOP, 0);
+  gc_stats.threshold = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 * PX_GC_GROWTH;
+  mem_pool.limit = gc_stats.threshold * PX_GC_LIMIT;
 
   // loop
-  last_tick = SDL_GetTicks(); delta_ticks = 0;
+  last = SDL_GetPerformanceCounter(); tick_accumulator = 0;
   while (running) {
+    px_frame_begin();
     // fetch events
     while (SDL_PollEvent(&ev)) {
       switch (ev.type) {
@@ -1200,33 +3863,478 @@ static void px_run_main_loop(lua_State *L) {
       case SDL_MOUSEMOTION: inputs[0].mouse.x = ev.motion.x; inputs[0].mouse.y = ev.motion.y; break;
       }
     }
-    // update callback
-    current_tick = SDL_GetTicks();
-    delta_ticks += current_tick - last_tick;
-    last_tick = current_tick;
-    for (; delta_ticks >= PX_FPS_TICKS; delta_ticks -= PX_FPS_TICKS) {
-      // do update call
-      if (lua_getglobal(L, "update") == LUA_TFUNCTION) lua_call(L, 0, 0);
-      else lua_pop(L, 1);
+    // grow the audio buffer when the mixer got close to its deadline
+    if (SDL_AtomicGet(&audio_grow)) px_audio_open(L, audio_samples * 2);
+    px_audio_collect(L);
+    px_audio_markers(L);
+    px_frame_mark(PX_STAGE_EVENTS);
+    // update callback, headless runs don't wait for the clock
+    current = SDL_GetPerformanceCounter();
+    lua_pushnumber(L, headless ? 1.0 / tick_rate : (lua_Number)(current - last) / (lua_Number)frequency);
+    px_call_callback(L, PX_CALLBACK_TICK, 1);
+    // an update is due whenever the accumulator exceeds `frequency`, this is exact for every tick rate
+    tick_accumulator += headless ? frequency : (current - last) * (Uint64)tick_rate;
+    last = current;
+    for (updates = 0; tick_accumulator >= frequency && running; tick_accumulator -= frequency, ++updates) {
+      // after a stall the time is skipped instead of running more and more updates to catch up
+      if (updates == PX_MAX_CATCHUP) { tick_accumulator %= frequency; break; }
+      // do update call, the tick rate may change during it
+      step = 1.0 / tick_rate;
+      px_call_callback(L, PX_CALLBACK_UPDATE, 0);
+      px_scheduler_run(L, tick_count);
+      // audio follows the ticks instead of the wall clock
+      if (audio_writer.lockstep) px_audio_write_tick();
       // reset input
       for (i = 0; i < PX_NUM_CONTROLLERS; ++i) inputs[i].pressed = 0;
+      tick_time += step;
+      if (++tick_count == (Uint32)frame_limit) running = SDL_FALSE;
     }
+    if (!updates) px_call_callback(L, PX_CALLBACK_IDLE, 0);
+    px_frame_mark(PX_STAGE_UPDATE);
+    // collect garbage until the next tick is due, headless runs have no time to spare
+    if (headless) px_collect_garbage(L, 0);
+    else {
+      left = (Sint64)((frequency - tick_accumulator % frequency) / (Uint64)tick_rate) - (Sint64)(SDL_GetPerformanceCounter() - current);
+      px_collect_garbage(L, (int)(left * 1000 / (Sint64)frequency) - PX_GC_RESERVE);
+    }
+    px_frame_mark(PX_STAGE_GC);
     // render stuff
-    px_render_screen(L);
+    // alpha is the time since the last update in ticks, for interpolating between two updates
+    lua_pushnumber(L, (lua_Number)(tick_accumulator % frequency) / (lua_Number)frequency);
+    px_call_callback(L, PX_CALLBACK_DRAW, 1);
+    px_frame_mark(PX_STAGE_DRAW);
+    if (!headless) {
+      if (show_stats) px_draw_stats();
+      px_render_screen(L);
+      if (show_stats) px_restore_stats();
+    }
+    px_frame_end();
   }
 }
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Precompiled games
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// A .pxb file starts with "PXB1", a flags byte (1 = LZ4 compressed) and the
+// uncompressed size (u32). The payload is a list of entries made of the name
+// length (u16), the name, the chunk size (u32) and the stripped bytecode. The
+// first entry is the game itself, all others are modules for require().
+
+static int px_dump_writer(lua_State *L, const void *p, size_t size, void *ud) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer*)ud, (const char*)p, size);
+  return 0;
+}
+
+// pushes the names of all modules required with a literal name by the source at `idx`
+static void px_find_requires(lua_State *L, int idx) {
+  const char *source = lua_tostring(L, idx), *name;
+  char quote;
+  int count = 0;
+  lua_newtable(L);
+  while ((source = SDL_strstr(source, "require")) != NULL) {
+    source += 7;
+    while (SDL_isspace(*source) || *source == '(') ++source;
+    if (*source != '"' && *source != '\'') continue;
+    quote = *source++;
+    for (name = source; *source && *source != quote && *source != '\n'; ++source);
+    if (*source != quote) continue;
+    lua_pushlstring(L, name, source - name);
+    lua_rawseti(L, -2, ++count);
+  }
+}
+
+// pushes the path of a Lua module like require() would find it, or nil
+static void px_search_module(lua_State *L, const char *name) {
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "searchpath");
+  lua_pushstring(L, name);
+  lua_getfield(L, -3, "path");
+  lua_call(L, 2, 1);
+  lua_remove(L, -2);
+}
+
+// -compile: writes the game and its modules as precompiled bytecode
+static int px_compile(lua_State *L, const char *output) {
+  luaL_Buffer buffer;
+  FILE *file;
+  const char *path = px_check_arg("-file"), *name, *data;
+  Uint8 header[9];
+  size_t size, length;
+  int i, count = 1, compress = px_check_parm("-compress") != 0;
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  // entries are stored as name, path, bytecode triples, the game itself has no name
+  lua_settop(L, 0);
+  lua_newtable(L);
+  lua_newtable(L); // modules already seen
+  lua_pushstring(L, ""); lua_rawseti(L, 1, 1);
+  lua_pushstring(L, path ? path : "game.lua"); lua_rawseti(L, 1, 2);
+  for (i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 1, i * 3 - 1);
+    path = lua_tostring(L, -1);
+    px_read_file(L, path);
+    // queue the modules it requires
+    px_find_requires(L, -1);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      name = lua_tostring(L, -1);
+      if (lua_getfield(L, 2, name) == LUA_TNIL) {
+        lua_pushboolean(L, 1); lua_setfield(L, 2, name);
+        // modules which aren't Lua files (e.g. pixl itself) are left to require()
+        px_search_module(L, name);
+        if (lua_isstring(L, -1)) {
+          ++count;
+          lua_pushstring(L, name); lua_rawseti(L, 1, count * 3 - 2);
+          lua_pushvalue(L, -1); lua_rawseti(L, 1, count * 3 - 1);
+        }
+        lua_pop(L, 1);
+      }
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+    // compile it
+    data = lua_tolstring(L, -1, &size);
+    lua_pushfstring(L, "@%s", path);
+    if (luaL_loadbuffer(L, data, size, lua_tostring(L, -1))) lua_error(L);
+    luaL_buffinit(L, &buffer);
+    if (lua_dump(L, px_dump_writer, &buffer, 1)) luaL_error(L, "unable to dump %s", path);
+    luaL_pushresult(&buffer);
+    lua_rawseti(L, 1, i * 3);
+    lua_pop(L, 4);
+  }
+
+  // put all entries together
+  luaL_buffinit(L, &buffer);
+  for (i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 1, i * 3 - 2);
+    name = lua_tolstring(L, -1, &length);
+    lua_rawgeti(L, 1, i * 3);
+    data = lua_tolstring(L, -1, &size);
+    lua_pop(L, 2); // both strings are anchored in the entries table
+    header[0] = (Uint8)(length & 0xFF); header[1] = (Uint8)(length >> 8);
+    px_write32(header + 2, (Uint32)size);
+    luaL_addlstring(&buffer, (const char*)header, 2);
+    luaL_addlstring(&buffer, name, length);
+    luaL_addlstring(&buffer, (const char*)header + 2, 4);
+    luaL_addlstring(&buffer, data, size);
+  }
+  luaL_pushresult(&buffer);
+  data = lua_tolstring(L, -1, &size);
+  SDL_memcpy(header, "PXB1", 4);
+  header[4] = (Uint8)compress;
+  px_write32(header + 5, (Uint32)size);
+  if (compress) {
+    length = LZ4_compressBound((int)size);
+    length = LZ4_compress_default(data, luaL_buffinitsize(L, &buffer, length), (int)size, (int)length);
+    if (!length) luaL_error(L, "compression failed");
+    luaL_pushresultsize(&buffer, length);
+    data = lua_tolstring(L, -1, &size);
+  }
+
+  // write the file
+  file = fopen(output, "wb");
+  if (!file) luaL_error(L, "cannot open %s for writing", output);
+  length = fwrite(header, 1, sizeof(header), file) + fwrite(data, 1, size, file);
+  fclose(file);
+  if (length != sizeof(header) + size) luaL_error(L, "cannot write %s", output);
+  printf("compile: %d files, %d bytes in %.3fs\n", count, (int)length, (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency());
+  return 0;
+}
+
+// pushes the main chunk of the game, either from Lua source or a precompiled .pxb file
+static void px_load_game(lua_State *L, const char *filename) {
+  FILE *file;
+  Uint8 header[9];
+  const Uint8 *p, *end;
+  char *data;
+  long size;
+  Uint32 raw_size, length;
+  int i, name_length, base = lua_gettop(L);
+
+  // a game inside the archive is used before the file system
+  i = px_archive_find(L, filename);
+  if (i >= 0) {
+    px_archive_read(L, i);
+    lua_pushfstring(L, "@%s", filename);
+    if (luaL_loadbufferx(L, lua_tostring(L, -2), lua_rawlen(L, -2), lua_tostring(L, -1), "bt")) lua_error(L);
+    lua_replace(L, base + 1);
+    lua_settop(L, base + 1);
+    return;
+  }
+
+  // anything without the header is handed to Lua
+  file = fopen(filename, "rb");
+  if (!file || fread(header, 1, sizeof(header), file) != sizeof(header) || SDL_memcmp(header, "PXB1", 4)) {
+    if (file) fclose(file);
+    if (luaL_loadfile(L, filename)) lua_error(L);
+    return;
+  }
+  raw_size = px_read32(header + 5);
+  fseek(file, 0, SEEK_END);
+  size = ftell(file) - (long)sizeof(header);
+  fseek(file, sizeof(header), SEEK_SET);
+  if (size < 0 || raw_size > PX_BYTECODE_MAX_SIZE) { fclose(file); luaL_error(L, "%s is corrupt", filename); }
+  // compressed data is read behind the space for the decompressed data
+  data = (char*)lua_newuserdata(L, (header[4] & 1) ? raw_size + (size_t)size : (size_t)size);
+  p = (const Uint8*)data;
+  if (header[4] & 1) data += raw_size;
+  length = (Uint32)fread(data, 1, size, file);
+  fclose(file);
+  if (length != (Uint32)size) luaL_error(L, "cannot read %s", filename);
+  if (header[4] & 1) {
+    if (LZ4_decompress_safe(data, (char*)p, (int)size, (int)raw_size) != (int)raw_size) luaL_error(L, "%s is corrupt", filename);
+  }
+  else if (length != raw_size) luaL_error(L, "%s is corrupt", filename);
+
+  // modules go into package.preload, the game itself is returned
+  end = p + raw_size;
+  lua_pushnil(L); // placeholder for the game
+  lua_getglobal(L, "package"); lua_getfield(L, -1, "preload");
+  for (i = 0; p < end; ++i) {
+    if (end - p < 2) luaL_error(L, "%s is corrupt", filename);
+    name_length = p[0] | (p[1] << 8);
+    if (end - p - 6 < name_length) luaL_error(L, "%s is corrupt", filename);
+    length = px_read32(p + 2 + name_length);
+    if ((Uint32)(end - p - 6 - name_length) < length) luaL_error(L, "%s is corrupt", filename);
+    lua_pushlstring(L, (const char*)p + 2, name_length);
+    lua_pushfstring(L, i ? "=%s" : "@%s", i ? lua_tostring(L, -1) : filename);
+    if (luaL_loadbufferx(L, (const char*)p + 6 + name_length, length, lua_tostring(L, -1), "b")) lua_error(L);
+    lua_remove(L, -2);
+    if (i) lua_rawset(L, -3);
+    else { lua_replace(L, base + 2); lua_pop(L, 1); }
+    p += 6 + name_length + length;
+  }
+  if (!i) luaL_error(L, "%s is empty", filename);
+  // the bytecode at base + 1 had to stay alive until every module was loaded
+  lua_copy(L, base + 2, base + 1);
+  lua_settop(L, base + 1);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Benchmarks
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static const char *bench_songs[PX_AUDIO_CHANNELS] = {
+  "W1 T150 L16 O4 CDEFGAB>C<BAGFEDC",
+  "W2 T150 L8 O3 C.E.G.>C.<G.E.",
+  "W5 T150 L4 O2 CGFG",
+  "WT T150 L16 O5 EDC<B>CDEGFEDC",
+  "WS T150 L32 O3 CC+DD+EFF+GG+AA+B",
+  "WN T150 L16 O6 CRCRCCRC",
+  "W2 T150 L8 O4 E&E16F16GR>C<B-AG",
+  "WT T150 L2 O1 C<G>"
+};
+
+static void px_audio_init_tables();
+
+static int px_bench_audio(lua_State *L) {
+  AudioChannel bench_channels[PX_AUDIO_CHANNELS];
+  Uint8 stream[PX_AUDIO_SAMPLES * 2 * sizeof(Sint16)];
+  Uint64 start;
+  Uint32 checksum = 0;
+  double elapsed;
+  const char *str = px_check_arg("-benchtime");
+  int i, samples, seconds = str ? SDL_atoi(str) : 60;
+
+  // prepare all channels with looping songs
+  mixing_frequency = (float)PX_AUDIO_FREQUENCY;
+  px_audio_init_tables();
+  SDL_zero(bench_channels);
+  for (i = 0; i < PX_AUDIO_CHANNELS; ++i) {
+    lua_pushstring(L, bench_songs[i]);
+    bench_channels[i].program = mml_compile(L, -1);
+    bench_channels[i].ref = LUA_NOREF;
+    bench_channels[i].voice = -1;
+    bench_channels[i].volume = PX_AUDIO_VOLUME;
+    bench_channels[i].looping = SDL_TRUE;
+  }
+
+  // mix everything and checksum the output
+  start = SDL_GetPerformanceCounter();
+  for (samples = 0; samples < seconds * PX_AUDIO_FREQUENCY; samples += PX_AUDIO_SAMPLES) {
+    px_audio_mix(bench_channels, PX_AUDIO_CHANNELS, NULL, stream, sizeof(stream));
+    for (i = 0; i < (int)sizeof(stream); ++i) checksum = checksum * 31 + stream[i];
+  }
+  elapsed = (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+  printf("audio: %d seconds, %d channels, %d samples in %.3fs\n", seconds, PX_AUDIO_CHANNELS, samples, elapsed);
+  printf("audio: %.0f samples/s (%.1fx realtime), checksum %08x\n", samples / elapsed, samples / elapsed / PX_AUDIO_FREQUENCY, checksum);
+  return 0;
+}
+
+// creates lots of small tables, closures and strings like a game does
+static const char *bench_alloc_script =
+  "local objects, n = {}, ...\n"
+  "for i = 1, n do\n"
+  "  local v = { x = i, y = i * 2, tag = 'e' .. (i % 100) }\n"
+  "  objects[i % 4096 + 1] = { v, function() return v.x + v.y end }\n"
+  "  if i % 8 == 0 then objects[(i * 7) % 4096 + 1] = nil end\n"
+  "end\n";
+
+static double px_bench_alloc_run(lua_State *L, MemPool *pool, int count) {
+  lua_State *B = pool ? lua_newstate(px_alloc, pool) : luaL_newstate();
+  Uint64 start;
+  double elapsed;
+  if (!B) luaL_error(L, "cannot create Lua state");
+  luaL_openlibs(B);
+  start = SDL_GetPerformanceCounter();
+  if (luaL_loadstring(B, bench_alloc_script)) luaL_error(L, "%s", lua_tostring(B, -1));
+  lua_pushinteger(B, count);
+  lua_call(B, 1, 0);
+  lua_close(B);
+  elapsed = (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+  return elapsed;
+}
+
+static int px_bench_alloc(lua_State *L) {
+  MemPool pool;
+  double system, pixl;
+  const char *str = px_check_arg("-benchtime");
+  int count = (str ? SDL_atoi(str) : 10) * 1000000;
+  SDL_zero(pool);
+  system = px_bench_alloc_run(L, NULL, count);
+  pixl = px_bench_alloc_run(L, &pool, count);
+  printf("alloc: %d iterations, system %.3fs, pixl %.3fs (%.2fx)\n", count, system, pixl, system / pixl);
+  printf("alloc: %.0f allocations, %d KB of slabs\n", (double)pool.allocations, (int)(pool.slab_bytes / 1024));
+  px_pool_destroy(&pool);
+  return 0;
+}
+
+static int px_bench(lua_State *L, const char *name) {
+  if (!SDL_strcmp(name, "audio")) return px_bench_audio(L);
+  if (!SDL_strcmp(name, "alloc")) return px_bench_alloc(L);
+  return luaL_error(L, "unknown benchmark " LUA_QS, name);
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Init & Shutdown
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+static void px_audio_open(lua_State *L, int samples) {
+  SDL_AudioSpec want, have;
+  int elapsed = SDL_AtomicGet(&audio_mix_max);
+
+  // close a previous device, channel state survives in the globals
+  if (audio_device) SDL_CloseAudioDevice(audio_device);
+  SDL_zero(want); SDL_zero(have);
+  want.callback = px_audio_mixer_callback;
+  want.channels = 2;
+  want.format = AUDIO_S16SYS;
+  want.freq = PX_AUDIO_FREQUENCY;
+  want.samples = (Uint16)samples;
+  audio_device = SDL_OpenAudioDevice(px_check_arg("-audio"), SDL_FALSE, &want, &have, 0);
+  if (!audio_device) luaL_error(L, "SDL_OpenAudioDevice() failed: %s", SDL_GetError());
+  if (have.format != AUDIO_S16SYS) luaL_error(L, "SDL_OpenAudioDevice() didn't provide AUDIO_S16SYS format");
+  if (have.channels != 2) luaL_error(L, "SDL_OpenAudioDevice() didn't provide stereo channels");
+  mixing_frequency = (float)have.freq;
+  audio_samples = have.samples;
+  audio_running = SDL_TRUE;
+  audio_deadline = (int)((Sint64)audio_samples * 1000000 / have.freq);
+  audio_last_callback = 0;
+  SDL_AtomicSet(&audio_mix_max, 0);
+  SDL_AtomicSet(&audio_grow, 0);
+  if (audio_adaptive) SDL_Log("PiXL audio buffer: %d samples (%d us), max mix time %d us", audio_samples, audio_deadline, elapsed);
+  SDL_PauseAudioDevice(audio_device, SDL_FALSE);
+}
+
+// sends the mixed audio to a WAV (or raw PCM) file instead of the sound card
+static void px_audio_open_writer(lua_State *L, const char *filename, int samples) {
+  static const Uint8 header[44] = { 'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 2, 0 };
+  const char *ext = SDL_strrchr(filename, '.');
+  audio_writer.file = fopen(filename, "wb");
+  if (!audio_writer.file) luaL_error(L, "cannot open audio output '%s'", filename);
+  audio_writer.wav = !ext || SDL_strcasecmp(ext, ".raw");
+  if (audio_writer.wav) fwrite(header, 1, sizeof(header), audio_writer.file); // completed when closed
+  audio_writer.buffer = (Uint8*)SDL_malloc(PX_AUDIO_WRITER);
+  audio_writer.mutex = SDL_CreateMutex();
+  audio_writer.cond = SDL_CreateCond();
+  if (!audio_writer.buffer || !audio_writer.mutex || !audio_writer.cond) luaL_error(L, "cannot create the audio writer");
+  audio_writer.thread = SDL_CreateThread(px_audio_writer_thread, "PiXL audio writer", NULL);
+  if (!audio_writer.thread) luaL_error(L, "SDL_CreateThread() failed: %s", SDL_GetError());
+
+  // headless runs mix exactly one tick of audio after every update
+  audio_writer.lockstep = headless;
+  audio_samples = headless ? SDL_min(PX_AUDIO_FREQUENCY / tick_rate, PX_AUDIO_MAX_SAMPLES) : samples;
+  audio_deadline = (int)((Sint64)audio_samples * 1000000 / PX_AUDIO_FREQUENCY);
+  audio_adaptive = SDL_FALSE;
+  audio_running = SDL_TRUE;
+  if (!audio_writer.lockstep) {
+    audio_writer.timer = SDL_CreateThread(px_audio_timer_thread, "PiXL audio timer", NULL);
+    if (!audio_writer.timer) luaL_error(L, "SDL_CreateThread() failed: %s", SDL_GetError());
+  }
+}
+
+static void px_audio_close_writer() {
+  Uint8 header[28];
+  if (!audio_writer.file) return;
+  if (audio_writer.timer) { SDL_AtomicSet(&audio_writer.quit, 1); SDL_WaitThread(audio_writer.timer, NULL); }
+  if (audio_writer.thread) {
+    SDL_LockMutex(audio_writer.mutex);
+    audio_writer.done = SDL_TRUE;
+    SDL_CondSignal(audio_writer.cond);
+    SDL_UnlockMutex(audio_writer.mutex);
+    SDL_WaitThread(audio_writer.thread, NULL);
+  }
+  // now the sizes of the WAV header are known
+  if (audio_writer.wav) {
+    px_write32(header, 36 + audio_writer.bytes);
+    px_write32(header + 4, 0x45564157); // "WAVE"
+    px_write32(header + 8, 0x20746D66); // "fmt "
+    px_write32(header + 12, 16);
+    px_write32(header + 16, 1 | (2 << 16)); // PCM, stereo
+    px_write32(header + 20, PX_AUDIO_FREQUENCY);
+    px_write32(header + 24, PX_AUDIO_FREQUENCY * 4);
+    fseek(audio_writer.file, 4, SEEK_SET);
+    fwrite(header, 1, sizeof(header), audio_writer.file);
+    px_write32(header, 4 | (16 << 16)); // block align, bits per sample
+    px_write32(header + 4, 0x61746164); // "data"
+    px_write32(header + 8, audio_writer.bytes);
+    fwrite(header, 1, 12, audio_writer.file);
+  }
+  fclose(audio_writer.file);
+  if (audio_writer.cond) SDL_DestroyCond(audio_writer.cond);
+  if (audio_writer.mutex) SDL_DestroyMutex(audio_writer.mutex);
+  SDL_free(audio_writer.buffer);
+  SDL_zero(audio_writer);
+}
+
+// the mixer reads programs, samples and songs owned by Lua, so it has to stop before lua_close()
+static void px_audio_shutdown() {
+  if (audio_device) SDL_CloseAudioDevice(audio_device);
+  audio_device = 0;
+  audio_running = SDL_FALSE;
+  px_audio_close_writer();
+}
+
+static void px_audio_init_tables() {
+  double step;
+  int i;
+  px_randomseed(4096); for (i = 0; i < PX_AUDIO_NOISE; ++i) audio_noise[i] = px_rand() % 8 - 4;
+  for (i = 0; i < PX_AUDIO_NOTES; ++i) {
+    step = SDL_pow(2.0, ((double)(i - PX_AUDIO_NOTE_OFFSET) - 49.0) / 12.0) * 440.0 / mixing_frequency;
+    audio_notes[i] = step < 0.5 ? (Uint32)(step * 4294967296.0) : 0x80000000;
+  }
+}
+
 static void px_create_texture(lua_State *L, int width, int height) {
   SDL_DisplayMode display_mode;
 
+  // there is nothing to show without a window
+  if (headless) { screen_width = width; screen_height = height; return; }
+
   // create new texture
   if (texture) SDL_DestroyTexture(texture);
   texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
@@ -1251,10 +4359,21 @@ static void px_create_texture(lua_State *L, int width, int height) {
 }
 
 static int px_lua_init(lua_State *L) {
-  SDL_AudioSpec want, have;
-  int i, flags;
+  int i, flags, samples;
   const char *str;
 
+  // run a benchmark instead of the game
+  str = px_check_arg("-bench");
+  if (str) return px_bench(L, str);
+
+  // precompile the game instead of running it
+  str = px_check_arg("-compile");
+  if (str) return px_compile(L, str);
+
+  // pack files into an archive instead of running the game
+  str = px_check_arg("-pack");
+  if (str) return px_pack(L, str);
+
   // setup some hints
   str = px_check_arg("-video");
   if (str) SDL_SetHint(SDL_HINT_RENDER_DRIVER, str);
@@ -1267,53 +4386,88 @@ static int px_lua_init(lua_State *L) {
   net_initialize(L);
 
   // init SDL
-  if (SDL_Init(SDL_INIT_EVERYTHING)) luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
+  headless = px_check_parm("-headless");
+  str = px_check_arg("-frames");
+  frame_limit = str ? SDL_atoi(str) : 0;
+  str = px_check_arg("-tickrate");
+  tick_rate = str ? SDL_atoi(str) : PX_TICK_RATE;
+  if (tick_rate < 1 || tick_rate > PX_MAX_TICK_RATE) luaL_error(L, "invalid tick rate %d", tick_rate);
+  if (SDL_Init(headless ? SDL_INIT_TIMER | SDL_INIT_EVENTS : SDL_INIT_EVERYTHING)) luaL_error(L, "SDL_Init() failed: %s", SDL_GetError());
 
   // create window + texture
-  window = SDL_CreateWindow(PX_WINDOW_TITLE, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, PX_SCREEN_WIDTH, PX_SCREEN_HEIGHT, flags);
-  if (!window) luaL_error(L, "SDL_CreateWindow() failed: %s", SDL_GetError());
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-  if (!renderer) luaL_error(L, "SDL_CreateRenderer() failed: %s", SDL_GetError());
+  if (!headless) {
+    window = SDL_CreateWindow(PX_WINDOW_TITLE, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, PX_SCREEN_WIDTH, PX_SCREEN_HEIGHT, flags);
+    if (!window) luaL_error(L, "SDL_CreateWindow() failed: %s", SDL_GetError());
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (!renderer) luaL_error(L, "SDL_CreateRenderer() failed: %s", SDL_GetError());
+    SDL_ShowCursor(0);
+  }
   px_create_texture(L, PX_SCREEN_WIDTH, PX_SCREEN_HEIGHT);
-  SDL_ShowCursor(0);
 
   // audio init
+  str = px_check_arg("-voices");
+  audio_voices = str ? SDL_atoi(str) : PX_AUDIO_POOL;
+  if (audio_voices < 2 * PX_AUDIO_CHANNELS) audio_voices = 2 * PX_AUDIO_CHANNELS;
+  if (audio_voices > PX_AUDIO_VOICES) audio_voices = PX_AUDIO_VOICES;
+  SDL_zero(audio_song);
+  audio_song.ref = LUA_NOREF;
+  for (i = 0; i < PX_AUDIO_VOICES; ++i) {
+    SDL_zerop(&channels[i]);
+    channels[i].ref = LUA_NOREF;
+    channels[i].voice = i;
+    channels[i].volume = PX_AUDIO_VOLUME;
+  }
+  mixing_frequency = (float)PX_AUDIO_FREQUENCY;
+  px_audio_init_tables();
   if (!px_check_parm("-nosound")) {
-    SDL_zero(want); SDL_zero(have);
-    want.callback = px_audio_mixer_callback;
-    want.channels = 1;
-    want.format = AUDIO_S8;
-    want.freq = PX_AUDIO_FREQUENCY;
-    want.samples = 1024 * 4;
-    str = px_check_arg("-audio");
-    audio_device = SDL_OpenAudioDevice(str, SDL_FALSE, &want, &have, 0);
-    if (have.format != AUDIO_S8) luaL_error(L, "SDL_OpenAudioDevice() didn't provide AUDIO_S8 format");
-    if (have.channels != 1) luaL_error(L, "SDL_OpenAudioDevice() didn't provide a mono channel");
-    if (!audio_device) luaL_error(L, "SDL_OpenAudioDevice() failed: %s", SDL_GetError());
-    mixing_frequency = (float)have.freq;
-    SDL_PauseAudioDevice(audio_device, SDL_FALSE);
+    samples = PX_AUDIO_SAMPLES;
+    str = px_check_arg("-audiobuffer");
+    if (str && !SDL_strcmp(str, "auto")) { audio_adaptive = SDL_TRUE; samples = PX_AUDIO_MIN_SAMPLES; }
+    else if (str) samples = SDL_atoi(str);
+    if (samples < PX_AUDIO_MIN_SAMPLES) samples = PX_AUDIO_MIN_SAMPLES;
+    if (samples > PX_AUDIO_MAX_SAMPLES) samples = PX_AUDIO_MAX_SAMPLES;
+    for (i = PX_AUDIO_MIN_SAMPLES; i < samples; i *= 2); // SDL wants a power of two
+    str = px_check_arg("-audioout");
+    if (str) px_audio_open_writer(L, str, i);
+    else if (!headless) px_audio_open(L, i);
   }
 
   // init some stuff
-  px_randomseed(4096); for (i = 0; i < PX_AUDIO_NOISE; ++i) audio_noise[i] = px_rand() % 8 - 4;
-  for (i = 0; i < PX_AUDIO_CHANNELS; ++i) SDL_zerop(&channels[i]);
+  SDL_zero(gc_stats);
+  lua_newtable(L); lua_newtable(L); // weak cache of compiled MML strings
+  lua_pushstring(L, "v"); lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2); lua_setfield(L, LUA_REGISTRYINDEX, PX_MML_CACHE);
+  luaL_newmetatable(L, PX_SONG_TYPE); lua_pop(L, 1);
+  luaL_newmetatable(L, PX_BUFFER_TYPE); luaL_setfuncs(L, buffer_methods, 0);
+  lua_pushvalue(L, -1); lua_setfield(L, -2, "__index"); lua_pop(L, 1);
+  luaL_newmetatable(L, PX_ENTITIES_TYPE); luaL_setfuncs(L, entities_methods, 0);
+  lua_pushvalue(L, -1); lua_setfield(L, -2, "__index"); lua_pop(L, 1);
   running = SDL_TRUE;
   SDL_zero(inputs); SDL_zero(translation);
   px_open_controllers(L);
   px_randomseed(47 * 1024); // reset prng
 
   // load the Lua script
+  px_init_callbacks(L);
+  px_scheduler_init();
+  str = px_check_arg("-profile");
+  if (str) px_profile_start(L, PX_PROFILE_INTERVAL);
+  str = px_check_arg("-archive");
+  if (str) px_archive_open(L, str);
   str = px_check_arg("-file");
-  if (luaL_loadfile(L, str ? str : "game.lua")) lua_error(L);
+  px_load_game(L, str ? str : "game.lua");
   lua_call(L, 0, 0);
 
   // run main loop
   px_run_main_loop(L);
+  str = px_check_arg("-profile");
+  if (str) px_profile_write(L, str);
   return 0;
 }
 
 static void px_shutdown() {
-  if (audio_device) SDL_CloseAudioDevice(audio_device);
+  px_archive_close();
+  SDL_free(scheduler.tasks);
   if (texture) SDL_DestroyTexture(texture);
   if (renderer) SDL_DestroyRenderer(renderer);
   if (window) SDL_DestroyWindow(window);
@@ -1332,22 +4486,31 @@ static void px_register_args(lua_State *L, int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
-  lua_State *L = luaL_newstate();
+  lua_State *L = lua_newstate(px_alloc, &mem_pool);
+  int status;
   margc = argc; margv = argv;
+  mem_pool.L = L;
+  lua_atpanic(L, px_panic);
   px_register_args(L, argc, argv);
   luaL_openlibs(L);
   luaL_requiref(L, "pixl", px_lua_open, 1);
   lua_getglobal(L, "debug"); lua_getfield(L, -1, "traceback"); lua_remove(L, -2);
   lua_pushcfunction(L, px_lua_init);
-  if (lua_pcall(L, 0, 0, -2) != LUA_OK) {
+  status = lua_pcall(L, 0, 0, -2);
+  px_audio_shutdown();
+  // a profiler the game didn't stop must not sample the closed state
+  px_profile_stop(L);
+  px_profile_free();
+  if (status != LUA_OK) {
     const char *message = luaL_gsub(L, lua_tostring(L, -1), "\t", "  ");
-    if (audio_device) SDL_PauseAudioDevice(audio_device, SDL_TRUE);
     #ifndef _WIN32
     fprintf(stderr, "=[ PiXL Panic ]=\n%s\n", message);
     #endif // _WIN32
     SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "PiXL Panic", message, window);
   }
+  mem_pool.limit = 0; // the state is gone, nothing to restart
   lua_close(L);
+  px_pool_destroy(&mem_pool);
   px_shutdown();
   return 0;
 }